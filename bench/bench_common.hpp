@@ -0,0 +1,121 @@
+#pragma once
+
+// Command line, results and JSON output shared by the benchmark binaries.
+
+#include "../threadpool/Threadpool.hpp"
+#include "../threadpool/LatencyHistogram.hpp"
+#include "../threadpool/SystemInfo.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench {
+	using clock = Threadpool::clock;
+
+	struct Result {
+		std::string name;
+		std::vector<std::pair<std::string, double>> metrics;          // In output order.
+		std::vector<std::pair<std::string, std::string>> labels = {}; // Written before the metrics.
+	};
+
+	struct Config {
+		Threadpool::thread_num threads = Threadpool::AUTO_THREADS;
+		double scale = 1;
+		std::string out;
+		std::string filter;
+
+		unsigned int numThreads() const {
+			return threads == Threadpool::AUTO_THREADS ? system_info::availableCpus() : static_cast<unsigned int>(threads);
+		}
+		bool selected(const std::string& name) const { return filter.empty() || name.find(filter) != std::string::npos; }
+	};
+
+	inline const char* usage() {
+		return " [--threads N] [--scale F] [--out path] [--filter substring]\n"
+			"  --threads  Pool size (default: available CPUs).\n"
+			"  --scale    Multiplies every workload's job count, e.g. 0.1 for a quick run (default 1).\n"
+			"  --out      Write the JSON results here instead of stdout.\n"
+			"  --filter   Only run benchmarks whose name contains this.\n";
+	}
+
+	inline bool parseArgs(int argc, char** argv, Config& config) {
+		for (int i = 1; i < argc; ++i) {
+			const bool hasValue = i + 1 < argc;
+			if (std::strcmp(argv[i], "--threads") == 0 && hasValue)
+				config.threads = static_cast<Threadpool::thread_num>(std::atoi(argv[++i]));
+			else if (std::strcmp(argv[i], "--scale") == 0 && hasValue)
+				config.scale = std::atof(argv[++i]);
+			else if (std::strcmp(argv[i], "--out") == 0 && hasValue)
+				config.out = argv[++i];
+			else if (std::strcmp(argv[i], "--filter") == 0 && hasValue)
+				config.filter = argv[++i];
+			else
+				return false;
+		}
+		return config.scale > 0 && (config.threads > 0 || config.threads == Threadpool::AUTO_THREADS);
+	}
+
+	inline double secondsSince(clock::time_point start) {
+		return std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+	inline std::size_t scaled(const Config& config, std::size_t count) {
+		return std::max<std::size_t>(1, static_cast<std::size_t>(static_cast<double>(count) * config.scale));
+	}
+
+	// Add <prefix>p50_ns, p90, p99, p999 and max metrics for the durations recorded in a histogram.
+	inline void addPercentiles(Result& result, const std::string& prefix, const LatencyHistogram& histogram) {
+		LatencyHistogram::Counts counts{};
+		histogram.addTo(counts);
+		const std::pair<const char*, double> percentiles[] = { {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}, {"max", 1} };
+		for (const auto& percentile : percentiles)
+			result.metrics.emplace_back(prefix + percentile.first + "_ns", static_cast<double>(LatencyHistogram::percentile(counts, percentile.second).count()));
+	}
+
+	// As above, for a pool's latency summary.
+	inline void addPercentiles(Result& result, const std::string& prefix, const Threadpool::LatencySummary& summary) {
+		const std::pair<const char*, std::chrono::nanoseconds> percentiles[] = {
+			{"p50", summary.p50}, {"p90", summary.p90}, {"p99", summary.p99}, {"p999", summary.p999}, {"max", summary.max} };
+		for (const auto& percentile : percentiles)
+			result.metrics.emplace_back(prefix + percentile.first + "_ns", static_cast<double>(percentile.second.count()));
+	}
+
+	inline void writeJson(std::ostream& out, const std::string& benchmark, const Config& config, const std::vector<Result>& results) {
+		out.precision(12);
+		out << "{\n  \"benchmark\": \"" << benchmark << "\",\n  \"version\": 1,\n";
+		out << "  \"threads\": " << config.numThreads() << ",\n";
+		out << "  \"available_cpus\": " << system_info::availableCpus() << ",\n";
+		out << "  \"scale\": " << config.scale << ",\n  \"results\": [";
+		for (std::size_t r = 0; r < results.size(); ++r) {
+			out << (r == 0 ? "\n" : ",\n") << "    {\"name\": \"" << results[r].name << '"';
+			for (const auto& label : results[r].labels)
+				out << ", \"" << label.first << "\": \"" << label.second << '"';
+			for (const auto& metric : results[r].metrics)
+				out << ", \"" << metric.first << "\": " << metric.second;
+			out << '}';
+		}
+		out << "\n  ]\n}\n";
+	}
+
+	// Write results to config.out, or stdout. Returns the process exit code.
+	inline int writeResults(const std::string& benchmark, const Config& config, const std::vector<Result>& results) {
+		if (config.out.empty()) {
+			writeJson(std::cout, benchmark, config, results);
+			return 0;
+		}
+		std::ofstream out(config.out);
+		writeJson(out, benchmark, config, results);
+		if (!out) {
+			std::cerr << "Couldn't write " << config.out << '\n';
+			return 1;
+		}
+		return 0;
+	}
+}
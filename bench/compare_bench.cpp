@@ -0,0 +1,235 @@
+/* Runs the same workloads through Threadpool::add, the pool's sender/receiver scheduler, std::async(std::launch::async),
+   a std::thread per job, and inline on the calling thread, reporting jobs per second, process CPU time and context switches (getrusage),
+   and heap allocations per job (counted by replacing the global operator new in this binary). POSIX only.
+   Jobs are submitted in waves, each waited on before the next, so the thread-per-job runners stay bounded.
+
+   See bench_common.hpp for the options. */
+
+#include "bench_common.hpp"
+#include "../threadpool/Scheduler.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+
+#include <sys/resource.h>
+
+namespace {
+	std::atomic<std::uint64_t> allocations{0};
+
+	void* countedAlloc(std::size_t size) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		if (void* ptr = std::malloc(size == 0 ? 1 : size))
+			return ptr;
+		throw std::bad_alloc();
+	}
+
+	void* countedAlignedAlloc(std::size_t size, std::align_val_t align) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		const std::size_t alignment = static_cast<std::size_t>(align);
+		// aligned_alloc needs the size to be a multiple of the alignment.
+		if (void* ptr = std::aligned_alloc(alignment, (std::max<std::size_t>(size, 1) + alignment - 1) / alignment * alignment))
+			return ptr;
+		throw std::bad_alloc();
+	}
+}
+
+void* operator new(std::size_t size) { return countedAlloc(size); }
+void* operator new[](std::size_t size) { return countedAlloc(size); }
+void* operator new(std::size_t size, std::align_val_t align) { return countedAlignedAlloc(size, align); }
+void* operator new[](std::size_t size, std::align_val_t align) { return countedAlignedAlloc(size, align); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+using namespace bench;
+
+namespace {
+	constexpr std::size_t WAVE = 256;
+
+	struct Usage {
+		clock::time_point wall;
+		double cpuSeconds;             // User and system time of the whole process.
+		std::uint64_t contextSwitches; // Voluntary and involuntary.
+		std::uint64_t allocations;
+	};
+
+	Usage sample() {
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+		const auto seconds = [](const timeval& tv) { return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6; };
+		return { clock::now(), seconds(usage.ru_utime) + seconds(usage.ru_stime),
+			static_cast<std::uint64_t>(usage.ru_nvcsw + usage.ru_nivcsw), allocations.load(std::memory_order_relaxed) };
+	}
+
+	// Integer work that the optimizer can't drop, roughly a nanosecond per iteration.
+	std::atomic<std::uint64_t> sink{0};
+	template<unsigned int Iterations>
+	void compute() {
+		std::uint64_t x = 0x9E3779B97F4A7C15ull;
+		for (unsigned int i = 0; i < Iterations; ++i)
+			x = x * 6364136223846793005ull + 1442695040888963407ull;
+		sink.fetch_add(x, std::memory_order_relaxed);
+	}
+
+	struct Workload {
+		const char* name;
+		void (*job)();
+		std::size_t jobs;
+	};
+
+	void runInline(void (*job)(), std::size_t jobs) {
+		for (std::size_t i = 0; i < jobs; ++i)
+			job();
+	}
+
+	void runThreadpool(Threadpool& pool, void (*job)(), std::size_t jobs) {
+		std::vector<std::future<void>> wave;
+		wave.reserve(WAVE);
+		for (std::size_t done = 0; done < jobs; done += wave.size(), wave.clear()) {
+			for (std::size_t i = done; i < jobs && i - done < WAVE; ++i)
+				wave.push_back(pool.add(job));
+			for (auto& future : wave)
+				future.get();
+		}
+	}
+
+	// Counts down the completions of a wave of scheduler operations.
+	struct WaveLatch {
+		std::mutex mutex;
+		std::condition_variable done;
+		std::size_t remaining = 0;
+
+		void arrive() {
+			std::lock_guard<std::mutex> lock{mutex};
+			if (--remaining == 0)
+				done.notify_one();
+		}
+		void wait() {
+			std::unique_lock<std::mutex> lock{mutex};
+			done.wait(lock, [this] { return remaining == 0; });
+		}
+	};
+
+	struct WaveReceiver {
+		void (*job)();
+		WaveLatch* latch;
+
+		void set_value() noexcept {
+			job();
+			latch->arrive();
+		}
+		void set_error(std::exception_ptr) noexcept { latch->arrive(); }
+		void set_stopped() noexcept { latch->arrive(); }
+	};
+
+	// Operation states are reused by every wave, so only starting them is measured: it allocates nothing.
+	void runScheduler(Threadpool& pool, void (*job)(), std::size_t jobs) {
+		using Operation = Threadpool::Scheduler::ScheduleSender::Operation<WaveReceiver>;
+		WaveLatch latch;
+		std::vector<std::optional<Operation>> wave(WAVE);
+		for (std::size_t done = 0; done < jobs; ) {
+			const std::size_t count = std::min(WAVE, jobs - done);
+			latch.remaining = count;
+			for (std::size_t i = 0; i < count; ++i) {
+				wave[i].emplace(pool, WaveReceiver{ job, &latch }); // What schedule().connect() returns, in place.
+				wave[i]->start();
+			}
+			latch.wait();
+			done += count;
+		}
+	}
+
+	void runAsync(void (*job)(), std::size_t jobs) {
+		std::vector<std::future<void>> wave;
+		wave.reserve(WAVE);
+		for (std::size_t done = 0; done < jobs; done += wave.size(), wave.clear()) {
+			for (std::size_t i = done; i < jobs && i - done < WAVE; ++i)
+				wave.push_back(std::async(std::launch::async, job));
+			for (auto& future : wave)
+				future.get();
+		}
+	}
+
+	void runThreads(void (*job)(), std::size_t jobs) {
+		std::vector<std::thread> wave;
+		wave.reserve(WAVE);
+		for (std::size_t done = 0; done < jobs; done += wave.size(), wave.clear()) {
+			for (std::size_t i = done; i < jobs && i - done < WAVE; ++i)
+				wave.emplace_back(job);
+			for (auto& thread : wave)
+				thread.join();
+		}
+	}
+
+	Result measure(const char* runner, const Workload& workload, std::size_t jobs, const std::function<void()>& run) {
+		const Usage before = sample();
+		run();
+		const Usage after = sample();
+		const double seconds = std::chrono::duration<double>(after.wall - before.wall).count();
+		const double perJob = 1.0 / static_cast<double>(jobs);
+		return { "compare", {
+			{"jobs", static_cast<double>(jobs)}, {"seconds", seconds},
+			{"jobs_per_second", static_cast<double>(jobs) / seconds},
+			{"cpu_seconds", after.cpuSeconds - before.cpuSeconds},
+			{"cpu_us_per_job", (after.cpuSeconds - before.cpuSeconds) * 1e6 * perJob},
+			{"context_switches", static_cast<double>(after.contextSwitches - before.contextSwitches)},
+			{"context_switches_per_job", static_cast<double>(after.contextSwitches - before.contextSwitches) * perJob},
+			{"allocations_per_job", static_cast<double>(after.allocations - before.allocations) * perJob} },
+			{ {"workload", workload.name}, {"runner", runner} } };
+	}
+}
+
+int main(int argc, char** argv) {
+	Config config;
+	if (!parseArgs(argc, argv, config)) {
+		std::cerr << "Usage: " << argv[0] << usage();
+		return 2;
+	}
+
+	const Workload workloads[] = {
+		{ "empty", [] {}, 100000 },
+		{ "compute_1us", compute<1000>, 50000 },
+		{ "compute_20us", compute<20000>, 10000 },
+	};
+	std::vector<Result> results;
+	for (const Workload& workload : workloads) {
+		const std::size_t jobs = scaled(config, workload.jobs);
+		if (config.selected(std::string(workload.name) + "/inline")) {
+			std::cerr << "Running " << workload.name << " inline..." << std::endl;
+			results.push_back(measure("inline", workload, jobs, [&] { runInline(workload.job, jobs); }));
+		}
+		if (config.selected(std::string(workload.name) + "/threadpool")) {
+			std::cerr << "Running " << workload.name << " on Threadpool..." << std::endl;
+			Threadpool pool(config.threads, config.threads, 0);
+			results.push_back(measure("threadpool", workload, jobs, [&] { runThreadpool(pool, workload.job, jobs); }));
+		}
+		if (config.selected(std::string(workload.name) + "/scheduler")) {
+			std::cerr << "Running " << workload.name << " on Threadpool's scheduler..." << std::endl;
+			Threadpool pool(config.threads, config.threads, 0);
+			results.push_back(measure("threadpool_scheduler", workload, jobs, [&] { runScheduler(pool, workload.job, jobs); }));
+		}
+		if (config.selected(std::string(workload.name) + "/async")) {
+			std::cerr << "Running " << workload.name << " with std::async..." << std::endl;
+			results.push_back(measure("std_async", workload, jobs, [&] { runAsync(workload.job, jobs); }));
+		}
+		if (config.selected(std::string(workload.name) + "/thread")) {
+			std::cerr << "Running " << workload.name << " with a std::thread per job..." << std::endl;
+			results.push_back(measure("std_thread", workload, jobs, [&] { runThreads(workload.job, jobs); }));
+		}
+	}
+
+	return writeResults("compare", config, results);
+}
@@ -0,0 +1,165 @@
+/* Replays a workload recorded with Threadpool::setWorkloadRecording against a pool configured from the command
+   line: jobs are submitted with the recorded arrival pattern (optionally sped up) and busy-wait for their recorded
+   run time. Writes the recorded and replayed queue waits, run times and makespan as JSON.
+
+   Usage: replay_bench <trace> [--threads N] [--max N] [--extend N] [--speed F] [--order O] [--executors]
+                       [--limit N] [--out path]
+     --threads    Initial pool size (default: available CPUs).
+     --max        Max pool size, 0 -> no limit (default: the larger of --threads and available CPUs).
+     --extend     Threads to extend the pool by when jobs are kept waiting (default 0).
+     --speed      Submit this many times faster than recorded, e.g. 2 to replay at twice the load (default 1).
+     --order      Dispatch order of the pool: fifo, lifo or lifo_slot (default fifo).
+     --executors  Submit each label's jobs through an executor of its own, so labels share CPU time fairly,
+                  instead of adding every job to the pool directly.
+     --limit      With --executors, how many of each label's jobs may run at once, 0 -> no limit (default 0). */
+
+#include "bench_common.hpp"
+#include "../threadpool/LatencyHistogram.hpp"
+#include "../threadpool/WorkloadTrace.hpp"
+
+#include <thread>
+
+using namespace bench;
+
+namespace {
+	struct ReplayConfig {
+		std::string trace;
+		Config pool;
+		Threadpool::thread_num maxThreads = Threadpool::AUTO_THREADS;
+		Threadpool::thread_num extend = 0;
+		double speed = 1;
+		const char* order = "fifo";
+		Threadpool::DispatchOrder dispatchOrder = Threadpool::DispatchOrder::FIFO;
+		bool executors = false;
+		Threadpool::thread_num limit = 0;
+	};
+
+	const std::pair<const char*, Threadpool::DispatchOrder> ORDERS[] = {
+		{ "fifo", Threadpool::DispatchOrder::FIFO },
+		{ "lifo", Threadpool::DispatchOrder::LIFO },
+		{ "lifo_slot", Threadpool::DispatchOrder::LIFO_SLOT },
+	};
+
+	bool parseOrder(const char* name, ReplayConfig& config) {
+		for (const auto& order : ORDERS) {
+			if (std::strcmp(name, order.first) == 0) {
+				config.order = order.first;
+				config.dispatchOrder = order.second;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool parseReplayArgs(int argc, char** argv, ReplayConfig& config) {
+		bool threadsGiven = false;
+		bool maxGiven = false;
+		for (int i = 1; i < argc; ++i) {
+			const bool hasValue = i + 1 < argc;
+			if (std::strcmp(argv[i], "--threads") == 0 && hasValue) {
+				config.pool.threads = static_cast<Threadpool::thread_num>(std::atoi(argv[++i]));
+				threadsGiven = true;
+			} else if (std::strcmp(argv[i], "--max") == 0 && hasValue) {
+				config.maxThreads = static_cast<Threadpool::thread_num>(std::atoi(argv[++i]));
+				maxGiven = true;
+			} else if (std::strcmp(argv[i], "--extend") == 0 && hasValue) {
+				config.extend = static_cast<Threadpool::thread_num>(std::atoi(argv[++i]));
+			} else if (std::strcmp(argv[i], "--speed") == 0 && hasValue) {
+				config.speed = std::atof(argv[++i]);
+			} else if (std::strcmp(argv[i], "--order") == 0 && hasValue) {
+				if (!parseOrder(argv[++i], config))
+					return false;
+			} else if (std::strcmp(argv[i], "--executors") == 0) {
+				config.executors = true;
+			} else if (std::strcmp(argv[i], "--limit") == 0 && hasValue) {
+				config.limit = static_cast<Threadpool::thread_num>(std::atoi(argv[++i]));
+			} else if (std::strcmp(argv[i], "--out") == 0 && hasValue) {
+				config.pool.out = argv[++i];
+			} else if (argv[i][0] != '-' && config.trace.empty()) {
+				config.trace = argv[i];
+			} else {
+				return false;
+			}
+		}
+		return !config.trace.empty() && config.speed > 0 && (!threadsGiven || config.pool.threads > 0) &&
+			(!maxGiven || config.maxThreads >= 0) && config.extend >= 0 && config.limit >= 0;
+	}
+
+	void spinFor(std::chrono::nanoseconds duration) {
+		const auto end = clock::now() + duration;
+		while (clock::now() < end) {}
+	}
+
+	// Sleep until shortly before the deadline, then spin, so arrivals keep their spacing.
+	void waitUntil(clock::time_point deadline) {
+		constexpr std::chrono::microseconds SPIN{100};
+		if (deadline - clock::now() > SPIN * 2)
+			std::this_thread::sleep_until(deadline - SPIN);
+		while (clock::now() < deadline) {}
+	}
+
+	Result recorded(const WorkloadTrace& trace) {
+		LatencyHistogram queueWait;
+		LatencyHistogram runTime;
+		std::int64_t end = 0;
+		for (const auto& job : trace.jobs) {
+			queueWait.record(std::chrono::nanoseconds(job.queue_wait_ns));
+			runTime.record(std::chrono::nanoseconds(job.run_ns));
+			end = std::max(end, job.submit_ns + job.queue_wait_ns + job.run_ns);
+		}
+		Result result{ "recorded", { {"jobs", static_cast<double>(trace.jobs.size())}, {"seconds", static_cast<double>(end) / 1e9} } };
+		addPercentiles(result, "queue_wait_", queueWait);
+		addPercentiles(result, "run_", runTime);
+		return result;
+	}
+
+	Result replay(const WorkloadTrace& trace, const ReplayConfig& config) {
+		Threadpool pool(config.pool.threads, config.maxThreads, config.extend);
+		pool.setLatencyTracking(true);
+		pool.setDispatchOrder(config.dispatchOrder);
+		std::vector<Threadpool::Executor> executors;
+		for (std::size_t label = 0; config.executors && label < std::max<std::size_t>(trace.labels.size(), 1); ++label)
+			executors.push_back(pool.makeExecutor(config.limit));
+
+		const auto start = clock::now();
+		for (const auto& job : trace.jobs) {
+			waitUntil(start + std::chrono::nanoseconds(static_cast<std::int64_t>(static_cast<double>(job.submit_ns) / config.speed)));
+			const std::chrono::nanoseconds runTime(job.run_ns);
+			if (config.executors)
+				executors[job.label < executors.size() ? job.label : 0].add(spinFor, runTime);
+			else
+				pool.addLabeled(job.label == 0 ? nullptr : trace.labels[job.label].c_str(), spinFor, runTime);
+		}
+		pool.waitOnAllJobs();
+		const double seconds = secondsSince(start);
+
+		const auto stats = pool.latencyStats();
+		Result result{ "replayed", {
+			{"jobs", static_cast<double>(stats.runTime.count)}, {"seconds", seconds}, {"speed", config.speed},
+			{"max_threads", static_cast<double>(config.maxThreads)}, {"extend", static_cast<double>(config.extend)},
+			{"final_threads", static_cast<double>(pool.numThreads())}, {"executor_limit", static_cast<double>(config.limit)} },
+			{ {"order", config.order}, {"submit", config.executors ? "executors" : "pool"} } };
+		addPercentiles(result, "queue_wait_", stats.queueWait);
+		addPercentiles(result, "run_", stats.runTime);
+		return result;
+	}
+}
+
+int main(int argc, char** argv) {
+	ReplayConfig config;
+	if (!parseReplayArgs(argc, argv, config)) {
+		std::cerr << "Usage: " << argv[0] << " <trace> [--threads N] [--max N] [--extend N] [--speed F]"
+			" [--order fifo|lifo|lifo_slot] [--executors] [--limit N] [--out path]\n";
+		return 2;
+	}
+	WorkloadTrace trace;
+	if (!trace.load(config.trace)) {
+		std::cerr << "Couldn't read a workload trace from " << config.trace << '\n';
+		return 1;
+	}
+
+	std::cerr << "Replaying " << trace.jobs.size() << " jobs..." << std::endl;
+	std::vector<Result> results{ recorded(trace) };
+	results.push_back(replay(trace, config));
+	return writeResults("replay", config.pool, results);
+}
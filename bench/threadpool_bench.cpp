@@ -0,0 +1,294 @@
+/* Throughput and latency benchmarks for Threadpool, written as JSON to stdout (or --out <path>) so runs can be
+   compared across versions. Progress goes to stderr.
+
+   See bench_common.hpp for the options. */
+
+#include "bench_common.hpp"
+#include "../threadpool/LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace bench;
+
+namespace {
+
+	// Busy the calling thread for the given wall time.
+	void spinFor(std::chrono::nanoseconds duration) {
+		const auto end = clock::now() + duration;
+		while (clock::now() < end) {}
+	}
+
+	// Empty jobs added by several producer threads at once, until all have run.
+	std::vector<Result> submitThroughput(const Config& config) {
+		std::vector<Result> results;
+		const std::size_t jobs = scaled(config, 1000000);
+		for (unsigned int producers : { 1u, 2u, 4u, 8u }) {
+			Threadpool pool(config.threads, config.threads, 0);
+			const std::size_t perProducer = jobs / producers;
+			const auto start = clock::now();
+			std::vector<std::thread> threads;
+			for (unsigned int p = 0; p < producers; ++p) {
+				threads.emplace_back([&pool, perProducer] {
+					for (std::size_t i = 0; i < perProducer; ++i)
+						pool.add([] {});
+				});
+			}
+			for (auto& thread : threads)
+				thread.join();
+			const double submitted = secondsSince(start);
+			pool.waitOnAllJobs();
+			const double seconds = secondsSince(start);
+			results.push_back({ "submit_throughput", {
+				{"producers", producers}, {"jobs", static_cast<double>(perProducer * producers)},
+				{"submit_seconds", submitted}, {"seconds", seconds},
+				{"jobs_per_second", static_cast<double>(perProducer * producers) / seconds} } });
+		}
+		return results;
+	}
+
+	// Time from add to the job starting, and to its future being ready, one job at a time.
+	std::vector<Result> dispatchLatency(const Config& config) {
+		Threadpool pool(config.threads, config.threads, 0);
+		LatencyHistogram start;
+		LatencyHistogram roundTrip;
+		const std::size_t jobs = scaled(config, 20000);
+		for (std::size_t i = 0; i < jobs; ++i) {
+			const auto added = clock::now();
+			auto started = pool.add([] { return clock::now(); }).get();
+			const auto done = clock::now();
+			start.record(started - added);
+			roundTrip.record(done - added);
+		}
+		Result result{ "dispatch_latency", { {"jobs", static_cast<double>(jobs)} } };
+		addPercentiles(result, "start_", start);
+		addPercentiles(result, "round_trip_", roundTrip);
+		return { result };
+	}
+
+	// One job spreads work over many jobs and waits on them, repeatedly.
+	std::vector<Result> fanOutFanIn(const Config& config) {
+		std::vector<Result> results;
+		for (std::size_t width : { std::size_t{16}, std::size_t{256} }) {
+			Threadpool pool(config.threads, config.threads, 0);
+			const std::size_t rounds = scaled(config, 2000000 / width / 10);
+			LatencyHistogram roundTime;
+			const auto start = clock::now();
+			for (std::size_t r = 0; r < rounds; ++r) {
+				const auto roundStart = clock::now();
+				Threadpool::TaskGroup group(pool);
+				std::atomic<std::uint64_t> sum{0};
+				for (std::size_t i = 0; i < width; ++i)
+					group.run([&sum, i] { sum += i; });
+				group.wait();
+				roundTime.record(clock::now() - roundStart);
+			}
+			const double seconds = secondsSince(start);
+			Result result{ "fan_out_fan_in", {
+				{"width", static_cast<double>(width)}, {"rounds", static_cast<double>(rounds)}, {"seconds", seconds},
+				{"jobs_per_second", static_cast<double>(rounds * width) / seconds} } };
+			addPercentiles(result, "round_", roundTime);
+			results.push_back(std::move(result));
+		}
+		return results;
+	}
+
+	// Recursive fork-join: every call above the cutoff runs one branch as a job, and waits on it while helping.
+	std::uint64_t fib(Threadpool& pool, unsigned int n, unsigned int cutoff) {
+		if (n < 2)
+			return n;
+		if (n <= cutoff)
+			return fib(pool, n - 1, cutoff) + fib(pool, n - 2, cutoff);
+		std::uint64_t left = 0;
+		Threadpool::TaskGroup group(pool);
+		group.run([&pool, &left, n, cutoff] { left = fib(pool, n - 1, cutoff); });
+		const std::uint64_t right = fib(pool, n - 2, cutoff);
+		group.wait();
+		return left + right;
+	}
+
+	std::vector<Result> forkJoinFib(const Config& config) {
+		const unsigned int n = config.scale >= 1 ? 32 : 27;
+		const unsigned int cutoff = 12;
+		Threadpool pool(config.threads, config.threads, 0);
+		const auto start = clock::now();
+		const std::uint64_t value = pool.add([&pool, n, cutoff] { return fib(pool, n, cutoff); }).get();
+		const double seconds = secondsSince(start);
+		return { { "fork_join_fib", { {"n", n}, {"cutoff", cutoff}, {"value", static_cast<double>(value)}, {"seconds", seconds} } } };
+	}
+
+	// A few long jobs among many short ones: how long the short ones are held up.
+	std::vector<Result> mixedJobs(const Config& config) {
+		Threadpool pool(config.threads, config.threads, 0);
+		pool.setLatencyTracking(true);
+		const std::size_t jobs = scaled(config, 50000);
+		const auto start = clock::now();
+		for (std::size_t i = 0; i < jobs; ++i) {
+			if (i % 100 == 0)
+				pool.add(spinFor, std::chrono::microseconds(1000));
+			else
+				pool.add(spinFor, std::chrono::microseconds(1));
+		}
+		pool.waitOnAllJobs();
+		const double seconds = secondsSince(start);
+		const auto stats = pool.latencyStats();
+		Result result{ "mixed_long_short", {
+			{"jobs", static_cast<double>(jobs)}, {"long_fraction", 0.01}, {"seconds", seconds},
+			{"jobs_per_second", static_cast<double>(jobs) / seconds},
+			{"queue_wait_p50_ns", static_cast<double>(stats.queueWait.p50.count())},
+			{"queue_wait_p99_ns", static_cast<double>(stats.queueWait.p99.count())},
+			{"queue_wait_max_ns", static_cast<double>(stats.queueWait.max.count())} } };
+		return { result };
+	}
+
+	/* Counts cache misses of the calling thread and of the threads it starts afterwards, which are added in as they
+	   exit. Only on Linux, where perf events are allowed; elsewhere misses() is -1 (run under a profiler instead). */
+	class CacheMissCounter {
+	public:
+		CacheMissCounter() {
+#ifdef __linux__
+			perf_event_attr attr{};
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+		}
+		~CacheMissCounter() {
+#ifdef __linux__
+			if (fd_ >= 0)
+				close(fd_);
+#endif
+		}
+		CacheMissCounter(const CacheMissCounter&) = delete;
+		CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+		double misses() const {
+#ifdef __linux__
+			std::uint64_t count = 0;
+			if (fd_ >= 0 && read(fd_, &count, sizeof(count)) == static_cast<ssize_t>(sizeof(count)))
+				return static_cast<double>(count);
+#endif
+			return -1;
+		}
+
+	private:
+		int fd_ = -1;
+	};
+
+	/* Divide and conquer over an array larger than the caches: each job rewrites its range, then splits it between
+	   two child jobs that rewrite their halves again. Children run right after their parent, so they find their
+	   parent's data in cache. */
+	std::uint64_t rewriteAndSplit(Threadpool& pool, std::uint32_t* data, std::size_t size, std::size_t leaf) {
+		std::uint64_t sum = 0;
+		for (std::size_t i = 0; i < size; ++i) {
+			data[i] = data[i] * 2654435761u + 1;
+			sum += data[i];
+		}
+		if (size <= leaf)
+			return sum;
+		std::uint64_t left = 0;
+		std::uint64_t right = 0;
+		Threadpool::TaskGroup group(pool);
+		group.run([&pool, &left, data, size, leaf] { left = rewriteAndSplit(pool, data, size / 2, leaf); });
+		group.run([&pool, &right, data, size, leaf] { right = rewriteAndSplit(pool, data + size / 2, size - size / 2, leaf); });
+		group.wait();
+		return sum + left + right;
+	}
+
+	std::vector<Result> dispatchOrder(const Config& config) {
+		const std::size_t size = std::size_t(1) << 22; // 16 MiB
+		const std::size_t leaf = std::size_t(1) << 12;
+		const std::size_t rounds = scaled(config, 20);
+		const std::pair<const char*, Threadpool::DispatchOrder> orders[] = {
+			{ "fifo", Threadpool::DispatchOrder::FIFO },
+			{ "lifo", Threadpool::DispatchOrder::LIFO },
+			{ "lifo_slot", Threadpool::DispatchOrder::LIFO_SLOT },
+		};
+		std::vector<std::uint32_t> data(size);
+		std::vector<Result> results;
+		for (const auto& order : orders) {
+			std::fill(data.begin(), data.end(), 1u);
+			const CacheMissCounter counter; // Before the pool, so its workers are counted.
+			double seconds = 0;
+			std::uint64_t value = 0;
+			{
+				Threadpool pool(config.threads, config.threads, 0);
+				pool.setDispatchOrder(order.second);
+				const auto start = clock::now();
+				for (std::size_t r = 0; r < rounds; ++r)
+					value += pool.add([&pool, &data, size, leaf] { return rewriteAndSplit(pool, data.data(), size, leaf); }).get();
+				seconds = secondsSince(start);
+			}
+			results.push_back({ "dispatch_order", {
+				{"rounds", static_cast<double>(rounds)}, {"bytes", static_cast<double>(size * sizeof(std::uint32_t))},
+				{"seconds", seconds}, {"cache_misses", counter.misses()}, {"value", static_cast<double>(value)} },
+				{ {"order", order.first} } });
+		}
+		return results;
+	}
+
+	// Cost of waitOnAllJobs on an idle pool, and after a single job.
+	std::vector<Result> waitCost(const Config& config) {
+		Threadpool pool(config.threads, config.threads, 0);
+		const std::size_t calls = scaled(config, 200000);
+		LatencyHistogram idle;
+		for (std::size_t i = 0; i < calls; ++i) {
+			const auto start = clock::now();
+			pool.waitOnAllJobs();
+			idle.record(clock::now() - start);
+		}
+		LatencyHistogram afterJob;
+		const std::size_t jobs = scaled(config, 20000);
+		for (std::size_t i = 0; i < jobs; ++i) {
+			const auto start = clock::now();
+			pool.add([] {});
+			pool.waitOnAllJobs();
+			afterJob.record(clock::now() - start);
+		}
+		Result result{ "wait_on_all_jobs", { {"idle_calls", static_cast<double>(calls)}, {"job_calls", static_cast<double>(jobs)} } };
+		addPercentiles(result, "idle_", idle);
+		addPercentiles(result, "after_job_", afterJob);
+		return { result };
+	}
+}
+
+int main(int argc, char** argv) {
+	Config config;
+	if (!parseArgs(argc, argv, config)) {
+		std::cerr << "Usage: " << argv[0] << usage();
+		return 2;
+	}
+
+	const std::pair<const char*, std::function<std::vector<Result>(const Config&)>> benchmarks[] = {
+		{ "submit_throughput", submitThroughput },
+		{ "dispatch_latency", dispatchLatency },
+		{ "fan_out_fan_in", fanOutFanIn },
+		{ "fork_join_fib", forkJoinFib },
+		{ "mixed_long_short", mixedJobs },
+		{ "wait_on_all_jobs", waitCost },
+		{ "dispatch_order", dispatchOrder },
+	};
+	std::vector<Result> results;
+	for (const auto& benchmark : benchmarks) {
+		if (!config.selected(benchmark.first))
+			continue;
+		std::cerr << "Running " << benchmark.first << "..." << std::endl;
+		for (auto& result : benchmark.second(config))
+			results.push_back(std::move(result));
+	}
+
+	return writeResults("threadpool", config, results);
+}
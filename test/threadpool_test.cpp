@@ -1,8 +1,26 @@
 #include "catch.hpp"
 #include "../threadpool/Threadpool.hpp"
+#include "../threadpool/Scheduler.hpp"
+#include "../threadpool/LatencyHistogram.hpp"
+#include "../threadpool/SystemInfo.hpp"
+#include "../threadpool/TraceBuffer.hpp"
+#include "../threadpool/WorkerLocal.hpp"
+#include "../threadpool/WorkloadTrace.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 #include <string>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 SCENARIO("A threadpool is constructed.", "[threadpool][construction]") {
 	WHEN("A threadpool is initialized with default parameters.") {
 		Threadpool pool;
@@ -13,6 +31,24 @@ SCENARIO("A threadpool is constructed.", "[threadpool][construction]") {
 	WHEN("A threadpool is initialized with many threads.") {
 		Threadpool pool(1000);
 	}
+	WHEN("A threadpool is initialized with many threads with small stacks.") {
+		Threadpool::ThreadOptions options;
+		options.stackSize = 64 * 1024;
+		Threadpool pool(1000, 1000, 0, options);
+		CHECK(pool.numThreads() == 1000);
+	}
+	WHEN("A threadpool is sized automatically.") {
+		Threadpool pool(Threadpool::AUTO_THREADS, Threadpool::AUTO_THREADS);
+		THEN("It has one thread per available CPU.") {
+			const auto cpus = system_info::availableCpus();
+			CHECK(cpus >= 1);
+			if (system_info::hardwareConcurrency() != 0)
+				CHECK(cpus <= system_info::hardwareConcurrency());
+			CHECK(pool.numThreads() == cpus);
+			CHECK(pool.refreshSizing() == static_cast<Threadpool::thread_num>(cpus));
+			CHECK(pool.numThreads() == cpus);
+		}
+	}
 }
 
 // ------------------ Test functions/functors ----------------------
@@ -55,6 +91,12 @@ namespace {
 	void waitFunc() {
 		std::this_thread::sleep_for(THREAD_WAIT_MILLIS);
 	}
+
+	// Busy the calling thread for the given CPU time.
+	void spinFor(std::chrono::microseconds cpuTime) {
+		const auto end = system_info::threadCpuTime() + cpuTime;
+		while (system_info::threadCpuTime() < end) {}
+	}
 }
 
 // -----------------------------------------------------------------
@@ -265,4 +307,1409 @@ SCENARIO("A threadpool is checked whether it is idle.", "[threadpool][isIdle]")
 			}
 		}
 	}
+	GIVEN("A threadpool resized beyond the workers it was sized for.") {
+		Threadpool pool(1, 0, 0);
+		pool.resize(8);
+
+		WHEN("Every worker is kept busy.") {
+			std::promise<void> release;
+			std::shared_future<void> released = release.get_future().share();
+			std::atomic<int> started{0};
+			for (int i = 0; i < 8; ++i)
+				pool.add([released, &started] { ++started; released.wait(); });
+			while (started < 8)
+				std::this_thread::yield();
+			const std::size_t busyIdle = pool.numIdleThreads();
+			const bool busyIsIdle = pool.isIdle();
+			release.set_value();
+			pool.waitOnAllJobs();
+			THEN("Busy workers are counted whichever worker ran them.") {
+				CHECK(busyIdle == 0);
+				CHECK_FALSE(busyIsIdle);
+				CHECK(pool.isIdle());
+				CHECK(pool.numIdleThreads() == 8);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool grows when jobs are kept waiting.", "[threadpool][extend]") {
+	GIVEN("A threadpool with one thread that may grow to two.") {
+		Threadpool pool(1, 2, 1);
+		pool.setGrowthDelay(std::chrono::milliseconds(50));
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+
+		WHEN("Its only thread is blocked and jobs queue up behind it.") {
+			auto blocked = pool.add([released] { released.wait(); });
+			auto first = pool.add(intFunc);
+			THEN("It does not grow before the jobs have waited.") {
+				CHECK(pool.numThreads() == 1);
+			}
+			std::this_thread::sleep_for(THREAD_WAIT_MILLIS);
+			auto second = pool.add(intFunc);
+			THEN("It grows once they have, and the queued jobs complete.") {
+				CHECK(pool.numThreads() == 2);
+				CHECK(first.get() == 4);
+				CHECK(second.get() == 4);
+			}
+			release.set_value();
+			blocked.get();
+		}
+	}
+	GIVEN("A threadpool without threads that may grow.") {
+		Threadpool pool(0, 0, 4);
+
+		WHEN("A job is added.") {
+			auto job = pool.add(intFunc);
+			THEN("It grows right away and runs the job.") {
+				REQUIRE(job.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+				CHECK(job.get() == 4);
+				CHECK(pool.numThreads() == 4);
+			}
+		}
+	}
+	GIVEN("A threadpool with one thread that may grow by one.") {
+		Threadpool pool(1, 0, 1);
+		pool.setGrowthDelay(std::chrono::milliseconds(1));
+
+		WHEN("Its only thread waits on a job it queued behind itself, and nothing else is added.") {
+			auto outer = pool.add([&pool] { return pool.add(intFunc).get(); });
+			const auto status = outer.wait_for(std::chrono::seconds(5));
+			if (status != std::future_status::ready)
+				pool.resize(2); // Unblock it, so a failure doesn't hang the test.
+			THEN("It grows once the queued job has waited, and both jobs complete.") {
+				CHECK(status == std::future_status::ready);
+				CHECK(outer.get() == 4);
+				CHECK(pool.numThreads() == 2);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool pins its threads to CPUs.", "[threadpool][affinity]") {
+	const auto topology = system_info::cpuTopology();
+	const int firstCpu = topology.empty() ? -1 : static_cast<int>(topology.front().cpu);
+
+	GIVEN("A threadpool with its threads pinned to an explicit CPU.") {
+		Threadpool::ThreadOptions options;
+		options.affinity = Threadpool::Affinity::EXPLICIT;
+		options.cpus = { topology.empty() ? 0u : topology.front().cpu };
+		Threadpool pool(2, 2, 0, options);
+
+		WHEN("Jobs check which CPU they run on.") {
+			auto first = pool.add(system_info::currentCpu);
+			auto second = pool.add(system_info::currentCpu);
+			THEN("They run on that CPU where pinning is supported.") {
+				if (firstCpu >= 0) {
+					CHECK(first.get() == firstCpu);
+					CHECK(second.get() == firstCpu);
+				}
+			}
+		}
+	}
+	WHEN("A threadpool is created with an explicit policy but no CPUs.") {
+		Threadpool::ThreadOptions options;
+		options.affinity = Threadpool::Affinity::EXPLICIT;
+		THEN("It is rejected.") {
+			CHECK_THROWS_AS(Threadpool(2, 2, 0, options), std::invalid_argument);
+		}
+	}
+	WHEN("Threadpools are created using each topology based policy.") {
+		for (auto affinity : { Threadpool::Affinity::COMPACT, Threadpool::Affinity::SCATTER, Threadpool::Affinity::PHYSICAL_CORES }) {
+			Threadpool::ThreadOptions options;
+			options.affinity = affinity;
+			Threadpool pool(Threadpool::AUTO_THREADS, Threadpool::AUTO_THREADS, Threadpool::DEFAULT_POOL_EXTEND_INCR, options);
+			// They have threads and run jobs.
+			const std::size_t threads = pool.numThreads();
+			CHECK(threads >= 1);
+			CHECK(pool.add(intFunc).get() == 4);
+			// Re-reading the CPUs sizes them the same way as the constructor did.
+			pool.refreshSizing();
+			CHECK(pool.numThreads() == threads);
+		}
+	}
+}
+
+SCENARIO("A threadpool queues jobs per NUMA node.", "[threadpool][numa]") {
+	const auto nodes = system_info::numaTopology();
+
+	GIVEN("A threadpool with workers grouped by NUMA node.") {
+		Threadpool::ThreadOptions options;
+		options.affinity = Threadpool::Affinity::NUMA_NODES;
+		Threadpool pool(Threadpool::AUTO_THREADS, Threadpool::AUTO_THREADS, Threadpool::DEFAULT_POOL_EXTEND_INCR, options);
+
+		THEN("It has a queue for each node.") {
+			CHECK(pool.numNodes() == std::max<std::size_t>(nodes.size(), 1));
+		}
+		WHEN("Jobs are added to each node.") {
+			for (std::size_t n = 0; n < nodes.size(); ++n) {
+				const auto [worker, cpu] = pool.addOnNode(nodes[n].id, [&pool] {
+					return std::make_pair(pool.currentWorkerIndex(), system_info::currentCpu());
+				}).get();
+				// Those not stolen by an idle worker of another node (workers are spread over nodes by index) run on
+				// one of that node's CPUs.
+				if (static_cast<std::size_t>(worker) % nodes.size() == n) {
+					const auto& cpus = nodes[n].cpus;
+					CHECK(std::find(cpus.begin(), cpus.end(), static_cast<unsigned int>(cpu)) != cpus.end());
+				}
+			}
+		}
+		WHEN("Jobs are added to a node that doesn't exist, or without a node.") {
+			auto onMissingNode = pool.addOnNode(12345, intFunc);
+			auto onCurrentNode = pool.add(intFunc);
+			THEN("They are still completed.") {
+				CHECK(onMissingNode.get() == 4);
+				CHECK(onCurrentNode.get() == 4);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool configures its threads.", "[threadpool][options]") {
+	GIVEN("A threadpool with named, low priority threads.") {
+		Threadpool::ThreadOptions options;
+		options.namePrefix = "pool-worker-";
+		options.nice = 5;
+		options.scheduling = Threadpool::Scheduling::IDLE;
+		options.stackSize = 512 * 1024;
+		Threadpool pool(1, 1, 0, options);
+
+		WHEN("A job reads its thread's settings.") {
+			// Catch's assertions aren't thread safe, so the job only reads the settings and the test thread checks them.
+			struct Settings {
+				std::string name;
+				int policy = -1;
+				int nice = 0;
+				std::size_t stackSize = 0;
+			};
+			auto result = pool.add([] {
+				Settings settings;
+#ifdef __linux__
+				char buffer[16] = {};
+				pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+				settings.name = buffer;
+				settings.policy = sched_getscheduler(0);
+				settings.nice = getpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)));
+				pthread_attr_t attributes;
+				if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+					pthread_attr_getstacksize(&attributes, &settings.stackSize);
+					pthread_attr_destroy(&attributes);
+				}
+#endif
+				return settings;
+			});
+			THEN("They are the configured ones.") {
+				const Settings settings = result.get();
+#ifdef __linux__
+				CHECK(settings.name == "pool-worker-0");
+				CHECK(settings.policy == SCHED_IDLE);
+				CHECK(settings.nice == 5);
+				CHECK(settings.stackSize >= options.stackSize);
+#else
+				(void)settings;
+#endif
+			}
+		}
+	}
+	GIVEN("A threadpool asking for a real-time policy, which may not be permitted.") {
+		Threadpool::ThreadOptions options;
+		options.scheduling = Threadpool::Scheduling::FIFO;
+		options.namePrefix = "a-very-long-worker-name-";
+		Threadpool pool(2, 2, 0, options);
+
+		THEN("Its threads still run jobs.") {
+			CHECK(pool.add(intFunc).get() == 4);
+		}
+	}
+}
+
+SCENARIO("A threadpool compensates for blocked jobs.", "[threadpool][blocking]") {
+	GIVEN("A threadpool with one thread that may not grow.") {
+		Threadpool pool(1, 1, 0);
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+
+		WHEN("Its only thread blocks inside a blocking region.") {
+			std::promise<void> entered;
+			auto blocked = pool.add([&pool, &entered, released] {
+				pool.blocking([&entered, released] {
+					entered.set_value();
+					released.wait();
+				});
+			});
+			entered.get_future().wait();
+			THEN("Another worker runs queued jobs in its place.") {
+				CHECK(pool.numBlockedThreads() == 1);
+				CHECK(pool.numThreads() == 2);
+				CHECK(pool.add(intFunc).get() == 4);
+			}
+			release.set_value();
+			blocked.get();
+			AND_WHEN("The blocking region ends.") {
+				pool.waitOnAllJobs();
+				for (int i = 0; i < 100 && pool.numThreads() > 1; ++i)
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				THEN("The extra worker retires.") {
+					CHECK(pool.numBlockedThreads() == 0);
+					CHECK(pool.numThreads() == 1);
+					CHECK(pool.add(intFunc).get() == 4);
+				}
+			}
+		}
+		WHEN("Blocking regions follow each other within the spare workers' grace period.") {
+			pool.setSpareWorkerGrace(std::chrono::seconds(10));
+			const auto blockOnce = [&pool] {
+				std::promise<void> unblock;
+				std::promise<void> entered;
+				auto blocked = pool.add([&pool, &entered, released = unblock.get_future().share()] {
+					pool.blocking([&entered, released] {
+						entered.set_value();
+						released.wait();
+					});
+				});
+				entered.get_future().wait();
+				const std::size_t threads = pool.numThreads();
+				unblock.set_value();
+				blocked.get();
+				pool.waitOnAllJobs();
+				return threads;
+			};
+			const std::size_t firstThreads = blockOnce();
+			std::this_thread::sleep_for(THREAD_WAIT_MILLIS);
+			const std::size_t spareThreads = pool.numThreads();
+			const std::size_t secondThreads = blockOnce();
+			THEN("The compensating worker is kept as a spare and reused.") {
+				CHECK(firstThreads == 2);
+				CHECK(spareThreads == 2);
+				CHECK(secondThreads == 2);
+			}
+			AND_WHEN("The grace period is shortened.") {
+				pool.setSpareWorkerGrace(std::chrono::microseconds(0));
+				blockOnce();
+				for (int i = 0; i < 100 && pool.numThreads() > 1; ++i)
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				THEN("The spare retires.") {
+					CHECK(pool.numThreads() == 1);
+				}
+			}
+		}
+		WHEN("A blocking region is entered outside of the pool.") {
+			const int result = pool.blocking(intFunc);
+			THEN("It just runs the function.") {
+				CHECK(result == 4);
+				CHECK(pool.numBlockedThreads() == 0);
+				CHECK(pool.numThreads() == 1);
+			}
+		}
+	}
+}
+
+SCENARIO("Executors share a threadpool's threads.", "[threadpool][executor]") {
+	GIVEN("A threadpool with several threads.") {
+		Threadpool pool(4, 4, 0);
+
+		WHEN("Jobs are added to an executor limited to one job at a time.") {
+			auto executor = pool.makeExecutor(1);
+			std::atomic<int> running{0};
+			std::atomic<int> maxRunning{0};
+			std::vector<std::future<void>> results;
+			for (int i = 0; i < 8; ++i) {
+				results.push_back(executor.add([&running, &maxRunning] {
+					const int now = ++running;
+					int max = maxRunning;
+					while (now > max && !maxRunning.compare_exchange_weak(max, now)) {}
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+					--running;
+				}));
+			}
+			THEN("They all complete, one at a time.") {
+				for (auto& result : results)
+					result.get();
+				CHECK(maxRunning == 1);
+				CHECK(executor.numPendingJobs() == 0);
+			}
+		}
+	}
+	GIVEN("A threadpool with several threads that may grow, and an executor limited to one job at a time.") {
+		Threadpool pool(4, 0, 4);
+		auto executor = pool.makeExecutor(1);
+
+		WHEN("Jobs are added to it slightly faster than it runs them, so they queue up behind its limit.") {
+			std::vector<std::future<void>> results;
+			for (int i = 0; i < 60; ++i) {
+				results.push_back(executor.add(spinFor, std::chrono::microseconds(2000)));
+				std::this_thread::sleep_for(std::chrono::microseconds(1500));
+			}
+			for (auto& result : results)
+				result.get();
+			THEN("The pool doesn't grow while its other workers are idle.") {
+				CHECK(pool.numThreads() == 4);
+			}
+		}
+	}
+	GIVEN("A threadpool with one thread that may grow, and an executor limited to one job at a time.") {
+		Threadpool pool(1, 0, 4);
+		auto executor = pool.makeExecutor(1);
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		auto blocked = executor.add([released] { released.wait(); });
+
+		WHEN("Its jobs queue up behind its limit for longer than the growth delay.") {
+			std::vector<std::future<int>> results;
+			for (int i = 0; i < 10; ++i)
+				results.push_back(executor.add(intFunc));
+			std::this_thread::sleep_for(THREAD_WAIT_MILLIS);
+			results.push_back(executor.add(intFunc));
+			const std::size_t threads = pool.numThreads();
+			release.set_value();
+			blocked.get();
+			THEN("The pool doesn't grow for them, and they complete.") {
+				CHECK(threads == 1);
+				for (auto& result : results)
+					CHECK(result.get() == 4);
+			}
+		}
+	}
+	GIVEN("A threadpool with one thread, and executors with different weights.") {
+		Threadpool pool(1, 1, 0);
+		auto heavy = pool.makeExecutor(0, 2);
+		auto light = pool.makeExecutor(0, 1);
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		auto blocked = pool.add([released] { released.wait(); });
+
+		WHEN("The heavier executor queues all of its jobs first.") {
+			std::mutex orderMutex;
+			std::string order;
+			auto record = [&orderMutex, &order](char c) {
+				spinFor(std::chrono::microseconds(200));
+				std::lock_guard<std::mutex> lock{orderMutex};
+				order += c;
+			};
+			for (int i = 0; i < 6; ++i)
+				heavy.add(record, 'H');
+			for (int i = 0; i < 3; ++i)
+				light.add(record, 'L');
+			release.set_value();
+			blocked.get();
+			pool.waitOnAllJobs();
+			THEN("Jobs run in proportion to the weights rather than in submission order.") {
+				REQUIRE(order.size() == 9);
+				CHECK(std::count(order.begin(), order.begin() + 3, 'H') == 2);
+				CHECK(std::count(order.begin(), order.begin() + 6, 'H') == 4);
+			}
+		}
+	}
+}
+
+SCENARIO("Executors share CPU time fairly between tenants.", "[threadpool][executor][fairness]") {
+	GIVEN("A threadpool with one thread, and an executor per tenant with equal weights.") {
+		Threadpool pool(1, 1, 0);
+		auto slow = pool.makeExecutor();
+		auto fast = pool.makeExecutor();
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		auto blocked = pool.add([released] { released.wait(); });
+
+		WHEN("One tenant queues long jobs before the other queues short ones.") {
+			// Snapshot of each tenant's CPU time part way through, while both still have jobs queued.
+			std::size_t completed = 0;
+			std::chrono::nanoseconds slowCpuTime{0};
+			std::chrono::nanoseconds fastCpuTime{0};
+			auto record = [&](std::chrono::microseconds cpuTime) {
+				spinFor(cpuTime);
+				if (++completed == 30) {
+					slowCpuTime = slow.stats().cpuTime;
+					fastCpuTime = fast.stats().cpuTime;
+				}
+			};
+			for (int i = 0; i < 10; ++i)
+				slow.add(record, std::chrono::microseconds(2000));
+			for (int i = 0; i < 40; ++i)
+				fast.add(record, std::chrono::microseconds(500));
+			CHECK(slow.stats().pendingJobs == 10);
+			CHECK(fast.stats().pendingJobs == 40);
+			release.set_value();
+			blocked.get();
+			pool.waitOnAllJobs();
+
+			THEN("While both have work, each gets a similar share of CPU time rather than of jobs.") {
+				// About 12ms each; a share of jobs would give the slow tenant four times the CPU time.
+				CHECK(slowCpuTime >= fastCpuTime / 2);
+				CHECK(slowCpuTime <= fastCpuTime * 2);
+			}
+			THEN("Their stats account for every job and its CPU time.") {
+				const auto slowStats = slow.stats();
+				const auto fastStats = fast.stats();
+				CHECK(slowStats.pendingJobs == 0);
+				CHECK(slowStats.runningJobs == 0);
+				CHECK(slowStats.completedJobs == 10);
+				CHECK(fastStats.completedJobs == 40);
+				CHECK(slowStats.cpuTime >= std::chrono::milliseconds(20));
+				CHECK(fastStats.cpuTime >= std::chrono::milliseconds(20));
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool is paused and resized at runtime.", "[threadpool][pause][resize]") {
+	GIVEN("A threadpool with two threads.") {
+		Threadpool pool(2, 0, 0);
+
+		WHEN("It is paused before a job is added.") {
+			pool.pause();
+			auto result = pool.add(intFunc);
+			THEN("The job stays queued until it is resumed.") {
+				CHECK(pool.isPaused());
+				CHECK(result.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+				CHECK(pool.numPendingJobs() == 1);
+				pool.resume();
+				CHECK_FALSE(pool.isPaused());
+				CHECK(result.get() == 4);
+			}
+		}
+		WHEN("It is resized up and then down while jobs are running.") {
+			std::vector<std::future<void>> results;
+			for (int i = 0; i < 20; ++i)
+				results.push_back(pool.add(spinFor, std::chrono::microseconds(2000)));
+			pool.resize(5);
+			CHECK(pool.numThreads() == 5);
+			pool.resize(1);
+			THEN("Every job still completes, and the extra threads retire.") {
+				for (auto& result : results)
+					result.get();
+				for (int i = 0; i < 100 && pool.numThreads() > 1; ++i)
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				CHECK(pool.numThreads() == 1);
+				CHECK(pool.add(intFunc).get() == 4);
+			}
+		}
+		WHEN("Its max threads is lowered below its size.") {
+			pool.setMaxThreads(1);
+			for (int i = 0; i < 100 && pool.numThreads() > 1; ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			THEN("It shrinks to the new limit and still runs jobs.") {
+				CHECK(pool.numThreads() == 1);
+				CHECK(pool.add(intFunc).get() == 4);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool is shut down.", "[threadpool][shutdown]") {
+	GIVEN("A threadpool with one thread busy on a job, and jobs queued behind it.") {
+		Threadpool pool(1, 1, 0);
+		std::promise<void> release;
+		std::shared_future<void> gate = release.get_future().share();
+		auto running = pool.add([gate] { gate.wait(); return 1; });
+		std::vector<std::future<int>> queued;
+		for (int i = 0; i < 3; ++i)
+			queued.push_back(pool.add(intFunc));
+		for (int i = 0; i < 100 && pool.numPendingJobs() != 3; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		WHEN("It is drained.") {
+			release.set_value();
+			const auto cancelled = pool.shutdown(Threadpool::ShutdownMode::DRAIN);
+			THEN("Every job runs, no more are accepted, and its threads are gone.") {
+				CHECK(cancelled == 0);
+				CHECK(pool.numThreads() == 0);
+				CHECK(pool.numIdleThreads() == 0);
+				CHECK(pool.stats().threads == 0);
+				CHECK(running.get() == 1);
+				for (auto& result : queued)
+					CHECK(result.get() == 4);
+				auto rejected = pool.add(intFunc);
+				CHECK_THROWS_AS(rejected.get(), Threadpool::JobCancelled);
+			}
+		}
+		WHEN("It is shut down after running jobs finish.") {
+			std::thread releaser([&release] {
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				release.set_value();
+			});
+			const auto cancelled = pool.shutdown(Threadpool::ShutdownMode::FINISH_RUNNING);
+			releaser.join();
+			THEN("The running job completes, the queued jobs are cancelled, and its threads are gone.") {
+				CHECK(cancelled == 3);
+				CHECK(pool.numThreads() == 0);
+				CHECK(running.get() == 1);
+				for (auto& result : queued)
+					CHECK_THROWS_AS(result.get(), Threadpool::JobCancelled);
+			}
+		}
+		WHEN("It is discarded.") {
+			const auto cancelled = pool.shutdown(Threadpool::ShutdownMode::DISCARD);
+			THEN("It returns without waiting for the running job.") {
+				CHECK(cancelled == 3);
+				CHECK(running.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+				release.set_value();
+				CHECK(running.get() == 1);
+			}
+		}
+		WHEN("It is drained with a deadline that passes.") {
+			const auto cancelled = pool.shutdown(Threadpool::ShutdownMode::DRAIN, Threadpool::clock::now() + std::chrono::milliseconds(50));
+			release.set_value();
+			THEN("The jobs still queued at the deadline are cancelled.") {
+				CHECK(cancelled == 3);
+				CHECK(running.get() == 1);
+				for (auto& result : queued)
+					CHECK_THROWS_AS(result.get(), Threadpool::JobCancelled);
+			}
+		}
+	}
+	GIVEN("A threadpool whose queued jobs are cleared.") {
+		Threadpool pool(0, 0, 0);
+		auto result = pool.add(intFunc);
+		pool.clearPendingJobs();
+		THEN("Their futures report the cancellation.") {
+			CHECK_THROWS_AS(result.get(), Threadpool::JobCancelled);
+		}
+	}
+}
+
+SCENARIO("Task groups wait on their own jobs.", "[threadpool][taskgroup]") {
+	GIVEN("A threadpool with a job that blocks until released.") {
+		Threadpool pool(2, 2, 0);
+		std::promise<void> release;
+		std::shared_future<void> gate = release.get_future().share();
+		auto other = pool.add([gate] { gate.wait(); });
+
+		WHEN("A task group runs jobs.") {
+			Threadpool::TaskGroup group(pool);
+			std::atomic<int> count{0};
+			for (int i = 0; i < 100; ++i)
+				group.run([&count] { ++count; });
+			group.wait();
+			THEN("Waiting on the group doesn't wait on the pool's other jobs.") {
+				CHECK(count == 100);
+				CHECK(group.numPendingJobs() == 0);
+				CHECK(other.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+				release.set_value();
+			}
+		}
+		WHEN("A task group's jobs throw.") {
+			Threadpool::TaskGroup group(pool);
+			group.run([] { throw std::runtime_error("first"); });
+			group.run(voidFunc);
+			group.run([] { throw std::logic_error("second"); });
+			std::size_t errors = 0;
+			try {
+				group.wait();
+			} catch (const Threadpool::TaskGroup::Errors& e) {
+				errors = e.exceptions.size();
+			}
+			release.set_value();
+			THEN("Waiting throws every exception, once.") {
+				CHECK(errors == 2);
+				CHECK_NOTHROW(group.wait());
+			}
+		}
+		WHEN("A task group is waited on with a timeout.") {
+			Threadpool::TaskGroup group(pool);
+			group.run([gate] { gate.wait(); });
+			const bool early = group.wait_for(std::chrono::milliseconds(50));
+			release.set_value();
+			const bool late = group.wait_for(std::chrono::seconds(10));
+			THEN("It reports whether the group finished in time.") {
+				CHECK_FALSE(early);
+				CHECK(late);
+			}
+		}
+	}
+	GIVEN("A threadpool with one thread.") {
+		Threadpool pool(1, 1, 0);
+
+		WHEN("A job waits on a task group of its own.") {
+			auto result = pool.add([&pool] {
+				Threadpool::TaskGroup group(pool);
+				std::atomic<int> count{0};
+				for (int i = 0; i < 10; ++i)
+					group.run([&count] { ++count; });
+				group.wait();
+				return count.load();
+			});
+			THEN("The worker runs the group's jobs itself instead of deadlocking.") {
+				REQUIRE(result.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+				CHECK(result.get() == 10);
+				CHECK(pool.numThreads() == 1);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool is waited on with a timeout.", "[threadpool][wait][idle]") {
+	GIVEN("A threadpool with an idle callback.") {
+		Threadpool pool(2, 2, 0);
+		std::atomic<int> idleCount{0};
+		pool.setIdleCallback([&idleCount] { ++idleCount; });
+
+		WHEN("A job blocks past the timeout.") {
+			std::promise<void> release;
+			std::shared_future<void> gate = release.get_future().share();
+			pool.add([gate] { gate.wait(); });
+			const bool early = pool.waitOnAllJobs_for(std::chrono::milliseconds(50));
+			release.set_value();
+			const bool late = pool.waitOnAllJobs_until(Threadpool::clock::now() + std::chrono::seconds(10));
+			THEN("The wait reports whether the pool became idle.") {
+				CHECK_FALSE(early);
+				CHECK(late);
+				CHECK(pool.isIdle());
+			}
+		}
+		WHEN("Batches of jobs are run to completion.") {
+			for (int batch = 0; batch < 3; ++batch) {
+				for (int i = 0; i < 10; ++i)
+					pool.add(voidFunc);
+				pool.waitOnAllJobs();
+				for (int i = 0; i < 100 && idleCount < batch + 1; ++i)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			THEN("The callback runs once each time the pool becomes idle.") {
+				CHECK(idleCount >= 1);
+				CHECK(idleCount <= 30);
+				const int before = idleCount;
+				pool.add(voidFunc).get();
+				for (int i = 0; i < 100 && idleCount == before; ++i)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				CHECK(idleCount == before + 1);
+			}
+		}
+	}
+}
+
+SCENARIO("Latency histograms summarize durations.", "[histogram]") {
+	GIVEN("A histogram of the durations 1 to 1000000ns.") {
+		LatencyHistogram histogram;
+		for (int i = 1; i <= 1000000; ++i)
+			histogram.record(std::chrono::nanoseconds(i));
+		LatencyHistogram::Counts counts{};
+		histogram.addTo(counts);
+		THEN("Its percentiles are within 1/16 of the true values.") {
+			CHECK(LatencyHistogram::total(counts) == 1000000);
+			const double fractions[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+			for (double fraction : fractions) {
+				const double expected = fraction * 1000000;
+				const double value = static_cast<double>(LatencyHistogram::percentile(counts, fraction).count());
+				CHECK(value >= expected * 15 / 16);
+				CHECK(value <= expected * 17 / 16);
+			}
+		}
+	}
+	GIVEN("Small and huge durations.") {
+		THEN("Each falls in a bucket that holds it.") {
+			const std::uint64_t values[] = { 0, 1, 15, 16, 17, 1000, 123456789, std::uint64_t{1} << 62 };
+			for (std::uint64_t value : values) {
+				const std::size_t index = LatencyHistogram::bucketIndex(value);
+				CHECK(index < LatencyHistogram::NUM_BUCKETS);
+				CHECK(LatencyHistogram::bucketValue(index) >= value);
+				if (index > 0)
+					CHECK(LatencyHistogram::bucketValue(index - 1) < value);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool records job latencies.", "[threadpool][latency]") {
+	GIVEN("A threadpool with latency tracking.") {
+		Threadpool pool(2, 2, 0);
+		pool.setLatencyTracking(true);
+
+		WHEN("Jobs are run.") {
+			std::vector<std::future<void>> results;
+			for (int i = 0; i < 50; ++i)
+				results.push_back(pool.add(spinFor, std::chrono::microseconds(200)));
+			for (auto& result : results)
+				result.get();
+			pool.waitOnAllJobs();
+			const auto stats = pool.latencyStats();
+			THEN("Their queue waits and run times are summarized.") {
+				CHECK(stats.queueWait.count == 50);
+				CHECK(stats.runTime.count == 50);
+				CHECK(stats.runTime.p50 >= std::chrono::microseconds(180));
+				CHECK(stats.runTime.p50 <= stats.runTime.p99);
+				CHECK(stats.runTime.p99 <= stats.runTime.max);
+				CHECK(stats.queueWait.p50 <= stats.queueWait.max);
+			}
+		}
+		WHEN("Tracking is turned off.") {
+			pool.setLatencyTracking(false);
+			pool.add(voidFunc).get();
+			pool.waitOnAllJobs();
+			THEN("Nothing is recorded.") {
+				CHECK(pool.latencyStats().runTime.count == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("Trace buffers keep their latest events.", "[trace]") {
+	GIVEN("A trace buffer that has overflowed.") {
+		TraceBuffer buffer(4, "test");
+		for (std::uint32_t i = 0; i < 10; ++i)
+			buffer.record(i, TraceEvent::EXTEND, nullptr, i);
+		const auto events = buffer.events();
+		THEN("It holds the last events, oldest first.") {
+			REQUIRE(events.size() >= 4);
+			REQUIRE(events.size() < 10);
+			CHECK(events.front().arg == 10 - events.size());
+			CHECK(events.back().arg == 9);
+			CHECK(events.back().time == 9);
+			CHECK(events.back().type == TraceEvent::EXTEND);
+		}
+	}
+}
+
+SCENARIO("A threadpool writes a trace of its activity.", "[threadpool][trace]") {
+	GIVEN("A threadpool with tracing.") {
+		Threadpool pool(2, 2, 0);
+		pool.setTracing(true);
+
+		WHEN("Labelled jobs are run and the trace is dumped.") {
+			for (int i = 0; i < 10; ++i)
+				pool.addLabeled("traced \"job\"", voidFunc).get();
+			pool.waitOnAllJobs();
+			const std::string path = "threadpool_test_trace.json";
+			const bool written = pool.dumpTrace(path);
+			std::ifstream in(path);
+			std::stringstream contents;
+			contents << in.rdbuf();
+			in.close();
+			std::remove(path.c_str());
+			const std::string trace = contents.str();
+
+			THEN("It's Chrome Trace Event JSON with the jobs and the workers parking.") {
+				CHECK(written);
+				CHECK(trace.rfind("{\"traceEvents\":[", 0) == 0);
+				CHECK(trace.find("\"name\":\"traced \\\"job\\\"\"") != std::string::npos);
+				CHECK(trace.find("\"name\":\"parked\"") != std::string::npos);
+				CHECK(trace.find("\"name\":\"worker 0\"") != std::string::npos);
+				CHECK(trace.find("]") != std::string::npos);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool profiles its locks.", "[threadpool][locks]") {
+	GIVEN("A threadpool with lock profiling.") {
+		Threadpool pool(2, 2, 0);
+		pool.setLockProfiling(true);
+
+		WHEN("Jobs are added and waited on.") {
+			for (int i = 0; i < 100; ++i)
+				pool.add(voidFunc);
+			pool.waitOnAllJobs();
+			const auto stats = pool.lockStats();
+			const auto& submit = stats.pool[static_cast<std::size_t>(LockSite::SUBMIT)];
+			const auto& dequeue = stats.queues[static_cast<std::size_t>(LockSite::DEQUEUE)];
+			const auto& wait = stats.pool[static_cast<std::size_t>(LockSite::WAIT)];
+			THEN("Each site's acquisitions are counted.") {
+				CHECK(submit.acquisitions == 100);
+				CHECK(submit.contended <= submit.acquisitions);
+				CHECK(submit.holdTime.count() > 0);
+				CHECK(dequeue.acquisitions > 0);
+				CHECK(wait.acquisitions == 1);
+				CHECK(stats.queues[static_cast<std::size_t>(LockSite::SUBMIT)].acquisitions == 100);
+			}
+		}
+		WHEN("The pool is paused and resumed, and an executor's stats are read.") {
+			auto executor = pool.makeExecutor();
+			pool.pause();
+			pool.resume();
+			executor.stats();
+			const auto other = pool.lockStats().pool[static_cast<std::size_t>(LockSite::OTHER)];
+			THEN("Those acquisitions of the pool lock are counted too.") {
+				CHECK(other.acquisitions >= 4);
+			}
+		}
+		WHEN("Profiling is turned off.") {
+			pool.setLockProfiling(false);
+			pool.add(voidFunc).get();
+			THEN("Nothing is counted.") {
+				CHECK(pool.lockStats().pool[static_cast<std::size_t>(LockSite::SUBMIT)].acquisitions == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool records its workload.", "[threadpool][workload]") {
+	GIVEN("A threadpool recording its workload.") {
+		Threadpool pool(2, 2, 0);
+		pool.setWorkloadRecording(true);
+
+		WHEN("Labelled and unlabelled jobs are run and the workload is taken.") {
+			for (int i = 0; i < 50; ++i) {
+				pool.addLabeled("a", voidFunc);
+				pool.addLabeled("b", voidFunc);
+				pool.add(voidFunc);
+			}
+			pool.waitOnAllJobs();
+			const WorkloadTrace trace = pool.takeWorkloadTrace();
+			const bool ordered = std::is_sorted(trace.jobs.begin(), trace.jobs.end(),
+				[](const auto& a, const auto& b) { return a.submit_ns < b.submit_ns; });
+			const auto labelled = std::count_if(trace.jobs.begin(), trace.jobs.end(), [](const auto& job) { return job.label != 0; });
+			THEN("Every job is there in submit order, and taking again returns nothing.") {
+				CHECK(trace.jobs.size() == 150);
+				CHECK(ordered);
+				CHECK(trace.jobs.front().submit_ns == 0);
+				CHECK(labelled == 100);
+				CHECK(trace.labels == std::vector<std::string>{"", "a", "b"});
+				CHECK(pool.takeWorkloadTrace().jobs.empty());
+			}
+		}
+		WHEN("The trace is saved and loaded.") {
+			for (int i = 0; i < 20; ++i)
+				pool.addLabeled(i % 2 ? "odd" : nullptr, voidFunc);
+			pool.waitOnAllJobs();
+			const WorkloadTrace trace = pool.takeWorkloadTrace();
+			const std::string path = "threadpool_test_workload.tpwl";
+			const bool saved = trace.save(path);
+			WorkloadTrace loaded;
+			const bool wasLoaded = loaded.load(path);
+			std::remove(path.c_str());
+			bool same = loaded.jobs.size() == trace.jobs.size();
+			for (std::size_t i = 0; same && i < trace.jobs.size(); ++i) {
+				const auto& a = trace.jobs[i];
+				const auto& b = loaded.jobs[i];
+				same = a.submit_ns == b.submit_ns && a.queue_wait_ns == b.queue_wait_ns && a.run_ns == b.run_ns && a.label == b.label;
+			}
+			THEN("The same jobs and labels are read back.") {
+				CHECK(saved);
+				CHECK(wasLoaded);
+				CHECK(same);
+				CHECK(loaded.labels == trace.labels);
+			}
+		}
+		WHEN("A file that isn't a trace is loaded.") {
+			WorkloadTrace loaded;
+			THEN("Loading fails and the trace is empty.") {
+				CHECK_FALSE(loaded.load("threadpool_test_missing.tpwl"));
+				CHECK(loaded.jobs.empty());
+			}
+		}
+		WHEN("A trace cut short in its last job is loaded.") {
+			for (int i = 0; i < 5; ++i)
+				pool.add(voidFunc);
+			pool.waitOnAllJobs();
+			const std::string path = "threadpool_test_truncated.tpwl";
+			const bool saved = pool.takeWorkloadTrace().save(path);
+			std::string data;
+			{
+				std::ifstream in(path, std::ios::binary);
+				data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			std::ofstream(path, std::ios::binary).write(data.data(), static_cast<std::streamsize>(data.size() - 1));
+			WorkloadTrace loaded;
+			const bool wasLoaded = loaded.load(path);
+			std::remove(path.c_str());
+			THEN("Loading fails and the trace is empty.") {
+				CHECK(saved);
+				CHECK_FALSE(wasLoaded);
+				CHECK(loaded.jobs.empty());
+			}
+		}
+	}
+}
+
+SCENARIO("Jobs accumulate into per-worker data.", "[threadpool][workerlocal]") {
+	GIVEN("A threadpool and a WorkerLocal counter.") {
+		Threadpool pool(4, 4, 0);
+		WorkerLocal<std::uint64_t> sums(pool);
+
+		WHEN("Jobs add to their worker's counter.") {
+			std::vector<std::future<std::pair<int, std::uintptr_t>>> futures;
+			for (std::uint64_t i = 1; i <= 1000; ++i) {
+				futures.push_back(pool.add([&pool, &sums, i] {
+					std::uint64_t& sum = sums.local();
+					sum += i;
+					return std::make_pair(pool.currentWorkerIndex(), reinterpret_cast<std::uintptr_t>(&sum));
+				}));
+			}
+			bool indicesValid = true;
+			bool aligned = true;
+			for (auto& future : futures) {
+				const auto [index, address] = future.get();
+				indicesValid = indicesValid && index >= 0 && index < 4;
+				aligned = aligned && address % Threadpool::CACHE_LINE_SIZE == 0;
+			}
+			THEN("Each job knows its worker, and the counters add up.") {
+				CHECK(indicesValid);
+				CHECK(aligned);
+				CHECK(sums.combine([](std::uint64_t a, std::uint64_t b) { return a + b; }) == 500500);
+				CHECK(sums.size() >= 1);
+				CHECK(sums.size() <= 4);
+			}
+			AND_WHEN("The counters are cleared.") {
+				sums.clear();
+				THEN("None are left.") {
+					CHECK(sums.size() == 0);
+				}
+			}
+		}
+		WHEN("Called from a thread that isn't a worker.") {
+			THEN("There's no worker index or local copy.") {
+				CHECK(pool.currentWorkerIndex() == -1);
+				CHECK_THROWS_AS(sums.local(), std::logic_error);
+			}
+		}
+		WHEN("Another pool's worker asks.") {
+			Threadpool other(1, 1, 0);
+			const int index = other.add([&pool] { return pool.currentWorkerIndex(); }).get();
+			THEN("It isn't one of this pool's workers.") {
+				CHECK(index == -1);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool reports a snapshot of its counters.", "[threadpool][stats]") {
+	GIVEN("A paused threadpool with two threads.") {
+		Threadpool pool(2, 2, 0);
+		pool.pause();
+
+		WHEN("Jobs are queued, then run.") {
+			for (int i = 0; i < 5; ++i)
+				pool.add(voidFunc);
+			pool.add([] { throw std::runtime_error("job failed"); });
+			const auto queued = pool.stats();
+			pool.resume();
+			pool.add([] {
+				const auto end = Threadpool::clock::now() + std::chrono::milliseconds(2);
+				while (Threadpool::clock::now() < end) {}
+			});
+			pool.waitOnAllJobs();
+			const auto done = pool.stats();
+			THEN("Queued jobs are pending until they complete, failed or not.") {
+				CHECK(queued.submittedJobs == 6);
+				CHECK(queued.pendingJobs == 6);
+				CHECK(queued.completedJobs == 0);
+				CHECK(done.submittedJobs == 7);
+				CHECK(done.pendingJobs == 0);
+				CHECK(done.completedJobs == 7);
+				CHECK(done.busyThreads == 0);
+				CHECK(done.idleThreads == 2);
+				CHECK(done.threads == 2);
+				CHECK(done.busyTime.count() > 0);
+			}
+		}
+		WHEN("Queued jobs are cleared, and jobs are added after shutdown.") {
+			for (int i = 0; i < 3; ++i)
+				pool.add(voidFunc);
+			pool.clearPendingJobs();
+			pool.shutdown(Threadpool::ShutdownMode::DRAIN);
+			pool.add(voidFunc);
+			const auto stats = pool.stats();
+			THEN("They're counted as cancelled and rejected.") {
+				CHECK(stats.submittedJobs == 3);
+				CHECK(stats.cancelledJobs == 3);
+				CHECK(stats.rejectedJobs == 1);
+				CHECK(stats.pendingJobs == 0);
+				CHECK(stats.completedJobs == 0);
+			}
+		}
+		WHEN("Another thread polls the stats while jobs run.") {
+			pool.resume();
+			std::atomic<bool> done{false};
+			std::uint64_t polls = 0;
+			bool consistent = true;
+			std::thread monitor([&] {
+				while (!done) {
+					const auto stats = pool.stats();
+					consistent = consistent && stats.busyThreads + stats.idleThreads == stats.threads && stats.threads == 2;
+					++polls;
+				}
+			});
+			for (int i = 0; i < 1000; ++i)
+				pool.add(voidFunc);
+			pool.waitOnAllJobs();
+			done = true;
+			monitor.join();
+			THEN("Every snapshot adds up.") {
+				CHECK(polls > 0);
+				CHECK(consistent);
+				CHECK(pool.stats().completedJobs == 1000);
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool starts queued jobs in the order asked for.", "[threadpool][dispatch]") {
+	GIVEN("A paused threadpool with one thread.") {
+		Threadpool pool(1, 1, 0);
+		pool.pause();
+		std::vector<int> order;
+		const auto record = [&order](int i) { order.push_back(i); };
+
+		WHEN("Jobs are added in the default order.") {
+			for (int i = 0; i < 3; ++i)
+				pool.add(record, i);
+			pool.resume();
+			pool.waitOnAllJobs();
+			THEN("They run oldest first.") {
+				CHECK(order == std::vector<int>{0, 1, 2});
+			}
+		}
+		WHEN("The pool dispatches LIFO.") {
+			pool.setDispatchOrder(Threadpool::DispatchOrder::LIFO);
+			for (int i = 0; i < 3; ++i)
+				pool.add(record, i);
+			pool.addWithOrder(Threadpool::DispatchOrder::FIFO, record, 3);
+			pool.resume();
+			pool.waitOnAllJobs();
+			THEN("They run newest first, apart from jobs added FIFO.") {
+				CHECK(order == std::vector<int>{2, 1, 0, 3});
+			}
+		}
+	}
+	GIVEN("A threadpool with one thread and jobs kept in LIFO slots.") {
+		Threadpool pool(1, 1, 0);
+		pool.setDispatchOrder(Threadpool::DispatchOrder::LIFO_SLOT);
+		std::vector<int> order;
+		const auto record = [&order](int i) { order.push_back(i); };
+
+		WHEN("A job adds several jobs.") {
+			pool.add([&pool, &record] {
+				for (int i = 0; i < 3; ++i)
+					pool.add(record, i);
+			});
+			pool.waitOnAllJobs();
+			THEN("The last one runs next, then the others in order.") {
+				CHECK(order == std::vector<int>{2, 0, 1});
+			}
+		}
+		WHEN("A job waits on a task group's job.") {
+			const auto workers = pool.add([&pool] {
+				Threadpool::TaskGroup group(pool);
+				int child = -2;
+				group.run([&pool, &child] { child = pool.currentWorkerIndex(); });
+				group.wait();
+				return std::make_pair(pool.currentWorkerIndex(), child);
+			}).get();
+			THEN("The waiting worker runs it itself.") {
+				CHECK(workers.first == 0);
+				CHECK(workers.second == 0);
+			}
+		}
+		WHEN("Queued jobs are cleared while one is kept.") {
+			std::future<void> kept;
+			pool.add([&pool, &kept] {
+				kept = pool.add([] {});
+				pool.clearPendingJobs();
+			}).get();
+			THEN("The kept job is cancelled.") {
+				CHECK_THROWS_AS(kept.get(), Threadpool::JobCancelled);
+			}
+		}
+	}
+	GIVEN("A threadpool with two threads, both busy.") {
+		Threadpool pool(2, 2, 0);
+		pool.setDispatchOrder(Threadpool::DispatchOrder::LIFO_SLOT);
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		std::atomic<bool> started{false};
+		pool.add([released, &started] { started = true; released.wait(); });
+		while (!started)
+			std::this_thread::yield();
+
+		WHEN("A job blocks on the future of a job it kept.") {
+			const int result = pool.add([&pool, &release] {
+				auto child = pool.add([] { return 42; });
+				release.set_value();
+				return child.get();
+			}).get();
+			THEN("The other worker takes the kept job once it's free.") {
+				CHECK(result == 42);
+			}
+		}
+		WHEN("A job blocks on the future of a job it kept, with other jobs queued.") {
+			const auto waited = pool.add([&pool, &release] {
+				for (int i = 0; i < 20; ++i)
+					pool.addWithOrder(Threadpool::DispatchOrder::FIFO, [] { std::this_thread::sleep_for(std::chrono::milliseconds(15)); });
+				auto child = pool.add([] { return 42; });
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				const auto start = std::chrono::steady_clock::now();
+				release.set_value();
+				child.get();
+				return std::chrono::steady_clock::now() - start;
+			}).get();
+			THEN("The other worker takes the kept job before the queued ones, as it has waited for long.") {
+				CHECK(waited < std::chrono::milliseconds(100));
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool's workers take queued jobs in batches.", "[threadpool][batch]") {
+	GIVEN("A paused threadpool with one thread and lock profiling.") {
+		Threadpool pool(1, 1, 0);
+		pool.setLockProfiling(true);
+		pool.pause();
+		std::vector<int> order;
+		const auto record = [&order](int i) { order.push_back(i); };
+
+		WHEN("Many jobs are queued and the pool resumes.") {
+			for (int i = 0; i < 100; ++i)
+				pool.add(record, i);
+			pool.resume();
+			pool.waitOnAllJobs();
+			const auto dequeue = pool.lockStats().queues[static_cast<std::size_t>(LockSite::DEQUEUE)];
+			THEN("They run in order, with fewer queue locks than jobs.") {
+				REQUIRE(order.size() == 100);
+				CHECK(std::is_sorted(order.begin(), order.end()));
+				CHECK(dequeue.acquisitions < 50);
+			}
+		}
+	}
+	GIVEN("A paused threadpool with one thread, about to take a batch behind a blocked job.") {
+		Threadpool pool(1, 1, 0);
+		pool.pause();
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		std::atomic<bool> started{false};
+		pool.add([released, &started] { started = true; released.wait(); });
+		std::vector<std::future<int>> batched;
+		for (int i = 0; i < 10; ++i)
+			batched.push_back(pool.add(intFunc));
+		pool.resume();
+		while (!started)
+			std::this_thread::yield();
+
+		WHEN("The pending jobs are cleared.") {
+			pool.clearPendingJobs();
+			release.set_value();
+			THEN("The batched jobs are cancelled too.") {
+				for (auto& job : batched)
+					CHECK_THROWS_AS(job.get(), Threadpool::JobCancelled);
+				CHECK(pool.stats().cancelledJobs == 10);
+			}
+		}
+		WHEN("The pool is paused.") {
+			pool.pause();
+			release.set_value();
+			pool.waitOnAllJobs_for(THREAD_WAIT_MILLIS);
+			THEN("The batched jobs wait with the rest, and run once it resumes.") {
+				CHECK(pool.numPendingJobs() == 10);
+				pool.resume();
+				for (auto& job : batched)
+					CHECK(job.get() == 4);
+			}
+		}
+	}
+	GIVEN("A paused threadpool with two threads, one of them blocked.") {
+		Threadpool pool(2, 2, 0);
+		pool.pause();
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		pool.add([released] { released.wait(); });
+		std::vector<std::future<int>> jobs;
+		for (int i = 0; i < 40; ++i)
+			jobs.push_back(pool.add(intFunc));
+
+		WHEN("The pool resumes.") {
+			pool.resume();
+			THEN("The other thread runs every job, including those batched by the blocked one.") {
+				for (auto& job : jobs)
+					CHECK(job.get() == 4);
+			}
+			release.set_value();
+		}
+	}
+	GIVEN("A paused threadpool with two threads, and a job queued ahead of the sibling it waits on.") {
+		Threadpool pool(2, 2, 0);
+		pool.pause();
+		std::shared_future<int> sibling;
+		auto waiter = pool.add([&sibling] {
+			const auto start = std::chrono::steady_clock::now();
+			sibling.wait();
+			return std::chrono::steady_clock::now() - start;
+		});
+		sibling = pool.add(intFunc).share();
+
+		WHEN("Many longer jobs are queued behind them, and the pool resumes.") {
+			for (int i = 0; i < 40; ++i)
+				pool.add([] { std::this_thread::sleep_for(std::chrono::milliseconds(15)); });
+			pool.resume();
+			const auto waited = waiter.get();
+			THEN("The other thread takes the sibling from the waiting job's batch once it has been held for long.") {
+				CHECK(waited < std::chrono::milliseconds(100));
+			}
+		}
+	}
+}
+
+SCENARIO("A threadpool runs jobs on the calling thread when they would wait too long.", "[threadpool][inline]") {
+	GIVEN("A threadpool with one thread.") {
+		Threadpool pool(1, 1, 0);
+		const auto caller = std::this_thread::get_id();
+		const auto runsOn = [] { return std::this_thread::get_id(); };
+
+		WHEN("A job is added while a worker is idle.") {
+			pool.waitOnAllJobs();
+			const auto thread = pool.addOrRun(std::chrono::microseconds(0), runsOn).get();
+			THEN("It is queued as usual.") {
+				CHECK(thread != caller);
+				CHECK(pool.stats().inlineJobs == 0);
+			}
+		}
+		WHEN("The pool is paused.") {
+			pool.pause();
+			auto future = pool.addOrRun(std::chrono::seconds(1), runsOn);
+			THEN("The job runs inline, and its future is ready.") {
+				REQUIRE(future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+				CHECK(future.get() == caller);
+				CHECK(pool.stats().inlineJobs == 1);
+				CHECK(pool.stats().submittedJobs == 0);
+			}
+			pool.resume();
+		}
+		WHEN("Its worker is busy with many jobs queued behind it.") {
+			std::promise<void> release;
+			std::shared_future<void> released = release.get_future().share();
+			std::atomic<bool> started{false};
+			pool.add([released, &started] { started = true; released.wait(); });
+			while (!started)
+				std::this_thread::yield();
+			for (int i = 0; i < 100; ++i)
+				pool.add(voidFunc);
+			auto urgent = pool.addOrRun(std::chrono::microseconds(50), runsOn);
+			auto patient = pool.addOrRun(std::chrono::seconds(10), runsOn);
+			auto failing = pool.addOrRun(std::chrono::microseconds(50), [] { throw std::runtime_error("inline"); });
+			THEN("Jobs that can't wait that long run inline, and the others are queued.") {
+				CHECK(urgent.get() == caller);
+				CHECK_THROWS_AS(failing.get(), std::runtime_error);
+				CHECK(patient.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+				release.set_value();
+				CHECK(patient.get() != caller);
+				CHECK(pool.stats().inlineJobs == 2);
+			}
+		}
+	}
+	GIVEN("A threadpool with one thread, and a function that uses it synchronously.") {
+		Threadpool pool(1, 1, 0);
+		const auto worker = [&pool] { return pool.currentWorkerIndex(); };
+
+		WHEN("It is called from another thread.") {
+			THEN("It runs on a worker.") {
+				CHECK(pool.runSync(worker) == 0);
+			}
+		}
+		WHEN("It is called from a job, with the only worker busy running that job.") {
+			const int result = pool.add([&pool, &worker] { return pool.runSync(worker) + pool.runSync(intFunc); }).get();
+			THEN("It runs inline instead of waiting on itself.") {
+				CHECK(result == 4);
+				CHECK(pool.stats().submittedJobs == 1);
+			}
+		}
+		WHEN("It throws.") {
+			THEN("The exception reaches the caller.") {
+				CHECK_THROWS_AS(pool.runSync([] { throw std::runtime_error("sync"); }), std::runtime_error);
+			}
+		}
+		WHEN("A stateful function and a reference argument are passed, from another thread and from a job.") {
+			struct Counter {
+				int calls = 0;
+				void operator()(int& total) { ++calls; ++total; }
+			};
+			Counter counter;
+			int total = 0;
+			pool.runSync(counter, total);
+			pool.add([&pool, &counter, &total] { pool.runSync(counter, total); }).get();
+			THEN("Both calls use the caller's function and argument rather than copies.") {
+				CHECK(counter.calls == 2);
+				CHECK(total == 2);
+			}
+		}
+	}
+}
+
+namespace {
+	// A receiver reporting how its sender completed, and on which of the pool's workers.
+	struct CompletionReceiver {
+		Threadpool* pool;
+		std::promise<std::string>* completion;
+		int* worker;
+
+		void set_value() noexcept {
+			*worker = pool->currentWorkerIndex();
+			completion->set_value("value");
+		}
+		void set_error(std::exception_ptr) noexcept { completion->set_value("error"); }
+		void set_stopped() noexcept { completion->set_value("stopped"); }
+	};
+}
+
+SCENARIO("A threadpool works as a sender/receiver scheduler.", "[threadpool][scheduler]") {
+	GIVEN("A threadpool with two threads and its scheduler.") {
+		Threadpool pool(2, 2, 0);
+		const auto scheduler = pool.get_scheduler();
+		std::promise<std::string> completion;
+		auto completed = completion.get_future();
+		int worker = -1;
+		const CompletionReceiver receiver{ &pool, &completion, &worker };
+
+		WHEN("Schedulers are compared.") {
+			Threadpool other(1, 1, 0);
+			THEN("They are equal if they are for the same pool.") {
+				CHECK(scheduler == pool.get_scheduler());
+				CHECK(scheduler != other.get_scheduler());
+			}
+		}
+		WHEN("A schedule sender is connected and started.") {
+			auto operation = scheduler.schedule().connect(receiver);
+			operation.start();
+			THEN("It completes on a worker.") {
+				CHECK(completed.get() == "value");
+				CHECK(worker >= 0);
+				CHECK(pool.stats().submittedJobs == 1);
+			}
+		}
+		WHEN("Its job is cleared before it runs.") {
+			pool.pause();
+			auto operation = scheduler.schedule().connect(receiver);
+			operation.start();
+			pool.clearPendingJobs();
+			pool.resume();
+			THEN("It completes stopped.") {
+				CHECK(completed.get() == "stopped");
+			}
+		}
+		WHEN("It is started after the pool shut down.") {
+			pool.shutdown(Threadpool::ShutdownMode::DRAIN);
+			auto operation = scheduler.schedule().connect(receiver);
+			operation.start();
+			THEN("It completes stopped.") {
+				CHECK(completed.get() == "stopped");
+			}
+		}
+		WHEN("A bulk sender runs a function over a range.") {
+			std::vector<std::atomic<int>> calls(1000);
+			auto operation = bulk(scheduler.schedule(), 1000, [&calls](int i) { ++calls[i]; }).connect(receiver);
+			operation.start();
+			THEN("It calls it once for every index, then completes on a worker.") {
+				CHECK(completed.get() == "value");
+				CHECK(std::all_of(calls.begin(), calls.end(), [](const std::atomic<int>& c) { return c == 1; }));
+				CHECK(worker >= 0);
+				CHECK(pool.stats().submittedJobs == 2); // One job per worker.
+			}
+		}
+		WHEN("A bulk sender's function throws.") {
+			auto operation = bulk(scheduler.schedule(), 100, [](int i) {
+				if (i == 50)
+					throw std::runtime_error("bulk");
+			}).connect(receiver);
+			operation.start();
+			THEN("It completes with the error.") {
+				CHECK(completed.get() == "error");
+			}
+		}
+		WHEN("A bulk sender has an empty range.") {
+			auto operation = bulk(scheduler.schedule(), 0, [](int) {}).connect(receiver);
+			operation.start();
+			THEN("It completes right away, without jobs.") {
+				CHECK(completed.get() == "value");
+				CHECK(pool.stats().submittedJobs == 0);
+			}
+		}
+	}
 }
@@ -0,0 +1,62 @@
+#include "LatencyHistogram.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+	unsigned int highestBit(std::uint64_t value) {
+		// Caller ensures value != 0.
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return static_cast<unsigned int>(index);
+#else
+		return 63 - static_cast<unsigned int>(__builtin_clzll(value));
+#endif
+	}
+}
+
+void LatencyHistogram::addTo(Counts& counts) const noexcept {
+	for (std::size_t i = 0; i < NUM_BUCKETS; ++i)
+		counts[i] += counts_[i].load(std::memory_order_relaxed);
+}
+
+std::size_t LatencyHistogram::bucketIndex(std::uint64_t value) noexcept {
+	if (value < SUB_BUCKETS)
+		return static_cast<std::size_t>(value);
+	// Values in [2^bit, 2^(bit+1)) share SUB_BUCKETS buckets, told apart by the bits below the highest.
+	const unsigned int shift = highestBit(value) - SUB_BUCKET_BITS;
+	return (shift + 1) * SUB_BUCKETS + static_cast<std::size_t>((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+std::uint64_t LatencyHistogram::bucketValue(std::size_t index) noexcept {
+	if (index < SUB_BUCKETS)
+		return index;
+	const std::size_t shift = index / SUB_BUCKETS - 1;
+	const std::uint64_t lowest = static_cast<std::uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+	return lowest + ((std::uint64_t{1} << shift) - 1);
+}
+
+std::uint64_t LatencyHistogram::total(const Counts& counts) noexcept {
+	std::uint64_t sum = 0;
+	for (std::uint64_t count : counts)
+		sum += count;
+	return sum;
+}
+
+std::chrono::nanoseconds LatencyHistogram::percentile(const Counts& counts, double fraction) noexcept {
+	const std::uint64_t sum = total(counts);
+	if (sum == 0)
+		return std::chrono::nanoseconds{0};
+	std::uint64_t rank = static_cast<std::uint64_t>(fraction * static_cast<double>(sum) + 0.5);
+	if (rank < 1)
+		rank = 1;
+	std::uint64_t seen = 0;
+	for (std::size_t i = 0; i < NUM_BUCKETS; ++i) {
+		seen += counts[i];
+		if (seen >= rank)
+			return std::chrono::nanoseconds(static_cast<std::int64_t>(bucketValue(i)));
+	}
+	return std::chrono::nanoseconds(static_cast<std::int64_t>(bucketValue(NUM_BUCKETS - 1)));
+}
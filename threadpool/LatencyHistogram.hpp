@@ -0,0 +1,38 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/* Log-linear histogram of durations in the style of HdrHistogram: each power of two is split into 16 buckets,
+   so recorded values are kept within 1/16 of their true value, from 1ns to centuries, in fixed space.
+   Recording is lock-free but only one thread may record into a histogram; any thread may read it. */
+class LatencyHistogram {
+public:
+	static constexpr unsigned int SUB_BUCKET_BITS = 4;
+	static constexpr std::size_t SUB_BUCKETS = std::size_t{1} << SUB_BUCKET_BITS;
+	static constexpr std::size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+	using Counts = std::array<std::uint64_t, NUM_BUCKETS>;
+
+	void record(std::chrono::nanoseconds duration) noexcept {
+		const std::uint64_t value = duration.count() > 0 ? static_cast<std::uint64_t>(duration.count()) : 0;
+		auto& bucket = counts_[bucketIndex(value)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); // Single writer.
+	}
+
+	// Add this histogram's counts to counts, e.g. to merge several histograms.
+	void addTo(Counts& counts) const noexcept;
+
+	static std::size_t bucketIndex(std::uint64_t value) noexcept;
+	// Highest value that falls in the bucket.
+	static std::uint64_t bucketValue(std::size_t index) noexcept;
+
+	static std::uint64_t total(const Counts& counts) noexcept;
+	// Smallest bucket value at least the given fraction (0 to 1) of the counted values are at or below. 0 if empty.
+	static std::chrono::nanoseconds percentile(const Counts& counts, double fraction) noexcept;
+
+private:
+	std::array<std::atomic<std::uint64_t>, NUM_BUCKETS> counts_{};
+};
@@ -0,0 +1,57 @@
+#include "LockProfile.hpp"
+
+namespace {
+	std::int64_t nanosSince(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+LockStats LockProfile::stats(LockSite site) const {
+	const Counters& counters = counters_[static_cast<std::size_t>(site)];
+	return { counters.acquisitions.load(std::memory_order_relaxed), counters.contended.load(std::memory_order_relaxed),
+		std::chrono::nanoseconds(counters.wait_ns.load(std::memory_order_relaxed)),
+		std::chrono::nanoseconds(counters.hold_ns.load(std::memory_order_relaxed)) };
+}
+
+ProfiledLock::ProfiledLock(std::mutex& mutex, LockProfile::Counters* counters)
+	: lock_(mutex, std::defer_lock), counters_(counters)
+{
+	lock();
+}
+
+ProfiledLock::~ProfiledLock() {
+	if (lock_.owns_lock())
+		unlock();
+}
+
+void ProfiledLock::lock() {
+	if (!counters_) {
+		lock_.lock();
+		return;
+	}
+	counters_->acquisitions.fetch_add(1, std::memory_order_relaxed);
+	if (lock_.try_lock()) {
+		_start_holding();
+		return;
+	}
+	const auto start = std::chrono::steady_clock::now();
+	lock_.lock();
+	_start_holding();
+	counters_->contended.fetch_add(1, std::memory_order_relaxed);
+	counters_->wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(held_since_ - start).count(), std::memory_order_relaxed);
+}
+
+void ProfiledLock::unlock() {
+	_stop_holding();
+	lock_.unlock();
+}
+
+void ProfiledLock::_start_holding() {
+	if (counters_)
+		held_since_ = std::chrono::steady_clock::now();
+}
+
+void ProfiledLock::_stop_holding() {
+	if (counters_)
+		counters_->hold_ns.fetch_add(nanosSince(held_since_), std::memory_order_relaxed);
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include "Threadpool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+// With stdexec available (C++20), the pool's senders also carry its concept tags, completion signatures and queries.
+#if __cplusplus >= 202002L && __has_include(<stdexec/execution.hpp>)
+#include <stdexec/execution.hpp>
+#define THREADPOOL_STDEXEC 1
+#else
+#define THREADPOOL_STDEXEC 0
+#endif
+
+/* A std::execution (P2300) scheduler for a pool's workers, from Threadpool::get_scheduler().
+
+   schedule() returns a sender that completes on a worker. bulk(schedule(scheduler), shape, func), found by
+   argument-dependent lookup, returns a sender that calls func(i) for every i in [0, shape) on the workers, as a
+   parallel for: one job per worker (at most MAX_BULK_JOBS), each taking blocks of indices until none are left.
+
+   Senders, receivers and operation states use the member functions of C++26 std::execution (connect, start,
+   set_value, set_error, set_stopped), so they work with stdexec-style libraries. Each operation state embeds the
+   jobs it queues, so starting one allocates nothing. Senders complete with set_stopped if their jobs are
+   cancelled (cleared, or added after shutdown), and bulk senders with set_error if func throws; the first
+   exception is kept and the remaining indices are skipped. start() is noexcept: it terminates if a job can't be
+   queued (out of memory, or the pool failing to start a thread it grows by). */
+class Threadpool::Scheduler {
+public:
+	static constexpr std::size_t MAX_BULK_JOBS = 64;
+
+	class ScheduleSender;
+	template<typename Shape, typename FuncType>
+	class BulkSender;
+
+#if THREADPOOL_STDEXEC
+	using scheduler_concept = stdexec::scheduler_t;
+#endif
+
+	ScheduleSender schedule() const noexcept;
+
+	bool operator==(const Scheduler& other) const noexcept { return pool_ == other.pool_; }
+	bool operator!=(const Scheduler& other) const noexcept { return pool_ != other.pool_; }
+
+	// The environment of the pool's senders: they complete on its scheduler.
+	struct Env {
+		Threadpool* pool;
+#if THREADPOOL_STDEXEC
+		template<typename Tag>
+		Scheduler query(stdexec::get_completion_scheduler_t<Tag>) const noexcept { return Scheduler(*pool); }
+#endif
+	};
+
+private:
+	friend class Threadpool;
+	explicit Scheduler(Threadpool& pool) noexcept : pool_(&pool) {}
+
+	// A job living in an operation state: the pool runs or cancels it, but never deletes it.
+	template<typename Operation>
+	struct OperationJob : public Job {
+		explicit OperationJob(Operation* operation = nullptr) noexcept : operation_(operation) { owned_ = false; }
+		void operator()() override { operation_->_run(); }
+		void cancel() override { operation_->_cancel(); }
+		Operation* operation_;
+	};
+
+	template<typename Receiver>
+	static void _set_value(Receiver& receiver) noexcept {
+#if THREADPOOL_STDEXEC
+		stdexec::set_value(std::move(receiver));
+#else
+		std::move(receiver).set_value();
+#endif
+	}
+	template<typename Receiver>
+	static void _set_error(Receiver& receiver, std::exception_ptr error) noexcept {
+#if THREADPOOL_STDEXEC
+		stdexec::set_error(std::move(receiver), std::move(error));
+#else
+		std::move(receiver).set_error(std::move(error));
+#endif
+	}
+	template<typename Receiver>
+	static void _set_stopped(Receiver& receiver) noexcept {
+#if THREADPOOL_STDEXEC
+		stdexec::set_stopped(std::move(receiver));
+#else
+		std::move(receiver).set_stopped();
+#endif
+	}
+	// Whether the receiver's stop token asks it to stop; receivers only have one with stdexec.
+	template<typename Receiver>
+	static bool _stop_requested([[maybe_unused]] const Receiver& receiver) noexcept {
+#if THREADPOOL_STDEXEC
+		return stdexec::get_stop_token(stdexec::get_env(receiver)).stop_requested();
+#else
+		return false;
+#endif
+	}
+
+	Threadpool* pool_;
+};
+
+class Threadpool::Scheduler::ScheduleSender {
+public:
+#if THREADPOOL_STDEXEC
+	using sender_concept = stdexec::sender_t;
+	using completion_signatures = stdexec::completion_signatures<stdexec::set_value_t(), stdexec::set_stopped_t()>;
+#endif
+
+	template<typename Receiver>
+	class Operation {
+	public:
+		Operation(Threadpool& pool, Receiver receiver) : pool_(pool), receiver_(std::move(receiver)), job_(this) {}
+		Operation(const Operation&) = delete;
+		Operation& operator=(const Operation&) = delete;
+
+		void start() & noexcept {
+			pool_._add(JobPtr(&job_), CURRENT_NODE);
+		}
+
+	private:
+		friend struct OperationJob<Operation>;
+
+		void _run() noexcept {
+			if (_stop_requested(receiver_))
+				_set_stopped(receiver_);
+			else
+				_set_value(receiver_);
+		}
+		void _cancel() noexcept { _set_stopped(receiver_); }
+
+		Threadpool& pool_;
+		Receiver receiver_;
+		OperationJob<Operation> job_;
+	};
+
+	template<typename Receiver>
+	Operation<std::decay_t<Receiver>> connect(Receiver&& receiver) const {
+		return Operation<std::decay_t<Receiver>>(*pool_, std::forward<Receiver>(receiver));
+	}
+
+	Env get_env() const noexcept { return Env{ pool_ }; }
+
+	// Customizes bulk for senders of this scheduler; see Scheduler.
+	template<typename Shape, typename FuncType>
+	friend BulkSender<Shape, std::decay_t<FuncType>> bulk(const ScheduleSender& sender, Shape shape, FuncType&& func) {
+		static_assert(std::is_integral_v<Shape>, "bulk's shape must be an integer");
+		return BulkSender<Shape, std::decay_t<FuncType>>(*sender.pool_, shape, std::forward<FuncType>(func));
+	}
+
+private:
+	friend class Scheduler;
+	explicit ScheduleSender(Threadpool& pool) noexcept : pool_(&pool) {}
+
+	Threadpool* pool_;
+};
+
+template<typename Shape, typename FuncType>
+class Threadpool::Scheduler::BulkSender {
+public:
+#if THREADPOOL_STDEXEC
+	using sender_concept = stdexec::sender_t;
+	using completion_signatures = stdexec::completion_signatures<
+		stdexec::set_value_t(), stdexec::set_error_t(std::exception_ptr), stdexec::set_stopped_t()>;
+#endif
+
+	BulkSender(Threadpool& pool, Shape shape, FuncType func) : pool_(&pool), shape_(shape), func_(std::move(func)) {}
+
+	template<typename Receiver>
+	class Operation {
+	public:
+		Operation(Threadpool& pool, Shape shape, FuncType func, Receiver receiver)
+			: pool_(pool), size_(shape > 0 ? static_cast<std::size_t>(shape) : 0), func_(std::move(func)),
+			  receiver_(std::move(receiver))
+		{
+			for (auto& job : jobs_)
+				job.operation_ = this;
+		}
+		Operation(const Operation&) = delete;
+		Operation& operator=(const Operation&) = delete;
+
+		void start() & noexcept {
+			if (size_ == 0) {
+				_set_value(receiver_);
+				return;
+			}
+			// Blocks of a quarter of each job's share, so jobs that start late or run slow indices still balance.
+			const std::size_t jobs = std::min({ size_, std::max<std::size_t>(pool_.numThreads(), 1), MAX_BULK_JOBS });
+			grain_ = std::max<std::size_t>(size_ / (jobs * 4), 1);
+			remaining_.store(jobs, std::memory_order_relaxed);
+			for (std::size_t i = 0; i < jobs; ++i)
+				pool_._add(JobPtr(&jobs_[i]), CURRENT_NODE);
+		}
+
+	private:
+		friend struct OperationJob<Operation>;
+
+		void _run() noexcept {
+			for (std::size_t begin = next_.fetch_add(grain_, std::memory_order_relaxed);
+				begin < size_ && !failed_.load(std::memory_order_relaxed);
+				begin = next_.fetch_add(grain_, std::memory_order_relaxed)) {
+				const std::size_t end = std::min(begin + grain_, size_);
+				try {
+					for (std::size_t i = begin; i < end; ++i)
+						func_(static_cast<Shape>(i));
+				} catch (...) {
+					if (!failed_.exchange(true, std::memory_order_relaxed))
+						error_ = std::current_exception();
+					break;
+				}
+				done_.fetch_add(end - begin, std::memory_order_relaxed);
+			}
+			_finish_job();
+		}
+		// Other jobs may still take the cancelled job's share; the sender is only stopped if indices are left.
+		void _cancel() noexcept { _finish_job(); }
+
+		void _finish_job() noexcept {
+			// The last job to finish completes the receiver; acq_rel makes the others' work and error visible to it.
+			if (remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				return;
+			if (error_)
+				_set_error(receiver_, std::move(error_));
+			else if (done_.load(std::memory_order_relaxed) < size_ || _stop_requested(receiver_))
+				_set_stopped(receiver_);
+			else
+				_set_value(receiver_);
+		}
+
+		Threadpool& pool_;
+		const std::size_t size_;
+		std::size_t grain_ = 1;
+		FuncType func_;
+		Receiver receiver_;
+		std::exception_ptr error_; // Written by the job that set failed_.
+		alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> next_{0};
+		std::atomic<std::size_t> done_{0};
+		std::atomic<std::size_t> remaining_{0};
+		std::atomic<bool> failed_{false};
+		std::array<OperationJob<Operation>, MAX_BULK_JOBS> jobs_;
+	};
+
+	template<typename Receiver>
+	Operation<std::decay_t<Receiver>> connect(Receiver&& receiver) && {
+		return Operation<std::decay_t<Receiver>>(*pool_, shape_, std::move(func_), std::forward<Receiver>(receiver));
+	}
+	template<typename Receiver>
+	Operation<std::decay_t<Receiver>> connect(Receiver&& receiver) const& {
+		return Operation<std::decay_t<Receiver>>(*pool_, shape_, func_, std::forward<Receiver>(receiver));
+	}
+
+	Env get_env() const noexcept { return Env{ pool_ }; }
+
+private:
+	Threadpool* pool_;
+	Shape shape_;
+	FuncType func_;
+};
+
+inline Threadpool::Scheduler Threadpool::get_scheduler() noexcept {
+	return Scheduler(*this);
+}
+
+inline Threadpool::Scheduler::ScheduleSender Threadpool::Scheduler::schedule() const noexcept {
+	return ScheduleSender(*pool_);
+}
@@ -0,0 +1,225 @@
+#include "SystemInfo.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <time.h>
+#endif
+
+namespace {
+#ifdef __linux__
+	// Quota and period in microseconds, as in cpu.cfs_quota_us and cpu.cfs_period_us. A quota <= 0 means no limit.
+	unsigned int cpusForQuota(long long quota, long long period) {
+		if (quota <= 0 || period <= 0)
+			return 0;
+		return static_cast<unsigned int>((quota + period - 1) / period);
+	}
+
+	// cgroup v2: "max 100000" or "<quota> <period>".
+	unsigned int readCpuMax(const std::string& dir) {
+		std::ifstream file(dir + "/cpu.max");
+		std::string quota;
+		long long period = 0;
+		if (!(file >> quota >> period) || quota == "max")
+			return 0;
+		long long quotaValue = 0;
+		if (!(std::istringstream(quota) >> quotaValue))
+			return 0;
+		return cpusForQuota(quotaValue, period);
+	}
+
+	// cgroup v1: separate cpu.cfs_quota_us (-1 if unlimited) and cpu.cfs_period_us files.
+	unsigned int readCfsQuota(const std::string& dir) {
+		std::ifstream quotaFile(dir + "/cpu.cfs_quota_us");
+		std::ifstream periodFile(dir + "/cpu.cfs_period_us");
+		long long quota = 0, period = 0;
+		if (!(quotaFile >> quota) || !(periodFile >> period))
+			return 0;
+		return cpusForQuota(quota, period);
+	}
+
+	// Reads a single integer from a sysfs file, or returns fallback.
+	int readInt(const std::string& path, int fallback) {
+		std::ifstream file(path);
+		int value = 0;
+		return file >> value ? value : fallback;
+	}
+
+	// Parses sysfs lists such as "0-3,8,10-11".
+	std::vector<unsigned int> readList(const std::string& path) {
+		std::vector<unsigned int> values;
+		std::ifstream file(path);
+		std::string list;
+		if (!(file >> list))
+			return values;
+		std::istringstream ranges(list);
+		for (std::string range; std::getline(ranges, range, ','); ) {
+			unsigned int first = 0, last = 0;
+			char dash = 0;
+			std::istringstream bounds(range);
+			if (!(bounds >> first))
+				continue;
+			if (!(bounds >> dash >> last))
+				last = first;
+			for (unsigned int value = first; value <= last; ++value)
+				values.push_back(value);
+		}
+		return values;
+	}
+
+	unsigned int minLimit(unsigned int a, unsigned int b) {
+		if (a == 0) return b;
+		if (b == 0) return a;
+		return std::min(a, b);
+	}
+
+	// The smallest limit read from the cgroup at mount + path and each of its ancestors up to the mount: a quota on
+	// any ancestor (such as a systemd slice) also caps the cgroups below it.
+	template<typename ReadLimit>
+	unsigned int minAncestorLimit(const std::string& mount, std::string path, ReadLimit readLimit) {
+		unsigned int limit = 0;
+		while (true) {
+			limit = minLimit(limit, readLimit(mount + path));
+			const auto slash = path.find_last_of('/');
+			if (path.empty() || slash == std::string::npos)
+				return limit;
+			path.erase(slash);
+		}
+	}
+#endif
+}
+
+namespace system_info {
+	unsigned int hardwareConcurrency() {
+		return std::thread::hardware_concurrency();
+	}
+
+	unsigned int affinityCpuCount() {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+			return static_cast<unsigned int>(CPU_COUNT(&set));
+#endif
+		return 0;
+	}
+
+	unsigned int cgroupCpuLimit() {
+#ifdef __linux__
+		// Lines are "<id>:<controllers>:<path>"; v2 has id 0 and no controllers. Check the cgroup's path under the mount
+		// and every ancestor up to the mount itself, where containers usually mount their own cgroup.
+		std::ifstream cgroups("/proc/self/cgroup");
+		unsigned int limit = 0;
+		for (std::string line; std::getline(cgroups, line); ) {
+			const auto first = line.find(':');
+			const auto second = line.find(':', first + 1);
+			if (first == std::string::npos || second == std::string::npos)
+				continue;
+			const std::string controllers = line.substr(first + 1, second - first - 1);
+			const std::string path = line.substr(second + 1);
+
+			if (controllers.empty()) {
+				limit = minLimit(limit, minAncestorLimit("/sys/fs/cgroup", path, readCpuMax));
+				continue;
+			}
+			std::istringstream names(controllers);
+			for (std::string name; std::getline(names, name, ','); ) {
+				if (name != "cpu")
+					continue;
+				for (const std::string& mount : { "/sys/fs/cgroup/" + controllers, std::string("/sys/fs/cgroup/cpu") })
+					limit = minLimit(limit, minAncestorLimit(mount, path, readCfsQuota));
+			}
+		}
+		return limit;
+#else
+		return 0;
+#endif
+	}
+
+	unsigned int availableCpus() {
+		unsigned int cpus = 0;
+		for (unsigned int limit : { hardwareConcurrency(), affinityCpuCount(), cgroupCpuLimit() }) {
+			if (limit != 0)
+				cpus = cpus == 0 ? limit : std::min(cpus, limit);
+		}
+		return std::max(cpus, 1u);
+	}
+
+	std::vector<CpuInfo> cpuTopology() {
+		std::vector<CpuInfo> cpus;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) != 0)
+			return cpus;
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (!CPU_ISSET(cpu, &set))
+				continue;
+			const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+			cpus.push_back({ static_cast<unsigned int>(cpu), readInt(dir + "physical_package_id", 0), readInt(dir + "core_id", cpu) });
+		}
+#endif
+		return cpus;
+	}
+
+	int currentCpu() {
+#ifdef __linux__
+		return sched_getcpu();
+#else
+		return -1;
+#endif
+	}
+
+	std::chrono::nanoseconds threadCpuTime() {
+#ifdef __linux__
+		timespec time;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == 0)
+			return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+#endif
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch());
+	}
+
+	std::vector<NodeInfo> numaTopology() {
+		std::vector<NodeInfo> nodes;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) != 0)
+			return nodes;
+
+		// Each node's distance file lists its distance to every online node, in id order.
+		const std::vector<unsigned int> online = readList("/sys/devices/system/node/online");
+		std::vector<std::vector<int>> distances;
+		std::vector<std::size_t> kept;
+		for (std::size_t i = 0; i < online.size(); ++i) {
+			const std::string dir = "/sys/devices/system/node/node" + std::to_string(online[i]) + "/";
+			NodeInfo node{ online[i], {}, {} };
+			for (unsigned int cpu : readList(dir + "cpulist")) {
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set))
+					node.cpus.push_back(cpu);
+			}
+			std::ifstream distanceFile(dir + "distance");
+			std::vector<int> row;
+			for (int distance; distanceFile >> distance; )
+				row.push_back(distance);
+			distances.push_back(std::move(row));
+			if (!node.cpus.empty()) {
+				nodes.push_back(std::move(node));
+				kept.push_back(i);
+			}
+		}
+		for (std::size_t n = 0; n < nodes.size(); ++n) {
+			for (std::size_t other : kept) {
+				const std::vector<int>& row = distances[kept[n]];
+				nodes[n].distances.push_back(other < row.size() ? row[other] : 0);
+			}
+		}
+#endif
+		return nodes;
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+// Queries about the machine the pool runs on. Values that can't be determined on this platform are reported as 0.
+namespace system_info {
+	// std::thread::hardware_concurrency(), or 0 if unknown.
+	unsigned int hardwareConcurrency();
+	// CPUs in this process's affinity mask (sched_getaffinity).
+	unsigned int affinityCpuCount();
+	// CPUs' worth of time the tightest CPU quota on this process's cgroup or its ancestors allows, rounded up
+	// (cgroup v2 cpu.max or v1 cpu.cfs_quota_us).
+	unsigned int cgroupCpuLimit();
+	// The smallest known limit of the above, and at least 1. Re-read from the system on every call.
+	unsigned int availableCpus();
+
+	struct CpuInfo {
+		unsigned int cpu;
+		int package; // Physical socket.
+		int core;    // Physical core within the package; hyperthreads of one core share it.
+	};
+	// CPUs in this process's affinity mask with their topology from /sys/devices/system/cpu, in CPU order.
+	// Empty if the topology is unknown on this platform.
+	std::vector<CpuInfo> cpuTopology();
+	// The CPU the calling thread is running on, or -1 if unknown.
+	int currentCpu();
+	// CPU time used by the calling thread. Falls back to wall time where per-thread CPU time isn't available.
+	std::chrono::nanoseconds threadCpuTime();
+
+	struct NodeInfo {
+		unsigned int id;
+		std::vector<unsigned int> cpus; // Only those in this process's affinity mask.
+		std::vector<int> distances;     // Relative distance to each node in numaTopology() order.
+	};
+	// NUMA nodes with CPUs this process may run on, from /sys/devices/system/node, in node id order.
+	// Empty if the topology is unknown on this platform.
+	std::vector<NodeInfo> numaTopology();
+}
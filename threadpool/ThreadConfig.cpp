@@ -0,0 +1,211 @@
+#include "ThreadConfig.hpp"
+#include "SystemInfo.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#ifdef __linux__
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	using system_info::CpuInfo;
+
+	struct RankedCpu {
+		CpuInfo info;
+		int sibling;   // Index among the hyperthreads of its core.
+		int coreIndex; // Index of its core within its package.
+	};
+
+	std::vector<RankedCpu> rankCpus(const std::vector<CpuInfo>& cpus) {
+		std::map<std::pair<int, int>, int> siblings;
+		std::map<int, std::map<int, int>> cores; // package -> core id -> index in package
+		for (const CpuInfo& cpu : cpus)
+			cores[cpu.package].emplace(cpu.core, 0);
+		for (auto& package : cores) {
+			int index = 0;
+			for (auto& core : package.second)
+				core.second = index++;
+		}
+
+		std::vector<RankedCpu> ranked;
+		ranked.reserve(cpus.size());
+		for (const CpuInfo& cpu : cpus)
+			ranked.push_back({ cpu, siblings[{ cpu.package, cpu.core }]++, cores[cpu.package][cpu.core] });
+		return ranked;
+	}
+
+	template <typename Key>
+	std::vector<unsigned int> orderBy(std::vector<RankedCpu> ranked, Key key) {
+		std::stable_sort(ranked.begin(), ranked.end(), [&key](const RankedCpu& a, const RankedCpu& b) {
+			return key(a) < key(b);
+		});
+		std::vector<unsigned int> order;
+		order.reserve(ranked.size());
+		for (const RankedCpu& cpu : ranked)
+			order.push_back(cpu.info.cpu);
+		return order;
+	}
+}
+
+namespace thread_config {
+#ifdef __linux__
+	struct Thread::Handle {
+		pthread_t thread;
+		std::function<void()> body;
+	};
+
+	namespace {
+		void* runThread(void* body) {
+			(*static_cast<std::function<void()>*>(body))();
+			return nullptr;
+		}
+	}
+
+	Thread::Thread(std::function<void()> body, std::size_t stackSize)
+		: handle_(std::make_unique<Handle>(Handle{ pthread_t{}, std::move(body) }))
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (stackSize > 0) {
+			// Round up to whole pages, and to the minimum the platform allows.
+			const long page = sysconf(_SC_PAGESIZE);
+			if (page > 0)
+				stackSize = (stackSize + page - 1) / page * page;
+			pthread_attr_setstacksize(&attr, std::max<std::size_t>(stackSize, PTHREAD_STACK_MIN));
+		}
+		int result = pthread_create(&handle_->thread, &attr, runThread, &handle_->body);
+		pthread_attr_destroy(&attr);
+		if (result != 0 && stackSize > 0) // Fall back to the default stack rather than fail.
+			result = pthread_create(&handle_->thread, nullptr, runThread, &handle_->body);
+		if (result != 0)
+			throw std::system_error(result, std::generic_category(), "Failed to start worker thread");
+	}
+
+	void Thread::join() {
+		if (handle_) {
+			pthread_join(handle_->thread, nullptr);
+			handle_.reset();
+		}
+	}
+#else
+	struct Thread::Handle {
+		std::thread thread;
+	};
+
+	Thread::Thread(std::function<void()> body, std::size_t)
+		: handle_(std::make_unique<Handle>(Handle{ std::thread(std::move(body)) }))
+	{}
+
+	void Thread::join() {
+		if (handle_) {
+			handle_->thread.join();
+			handle_.reset();
+		}
+	}
+#endif
+
+	Thread::~Thread() {
+		if (handle_) // Same as std::thread: destroying a running thread is a bug.
+			std::terminate();
+	}
+
+	Thread::Thread(Thread&&) noexcept = default;
+
+	Thread& Thread::operator=(Thread&& other) noexcept {
+		if (handle_)
+			std::terminate();
+		handle_ = std::move(other.handle_);
+		return *this;
+	}
+
+	bool configureCurrentThread(const Threadpool::ThreadOptions& options, std::size_t index) {
+		bool applied = true;
+#ifdef __linux__
+		using Scheduling = Threadpool::Scheduling;
+
+		if (!options.namePrefix.empty()) {
+			// Linux allows 15 characters. Shorten the prefix rather than the index, which tells workers apart.
+			const std::string suffix = std::to_string(index);
+			const std::string name = options.namePrefix.substr(0, 15 - std::min<std::size_t>(suffix.size(), 15)) + suffix;
+			applied &= pthread_setname_np(pthread_self(), name.c_str()) == 0;
+		}
+
+		if (options.scheduling != Scheduling::DEFAULT) {
+			int policy = SCHED_OTHER;
+			sched_param param{};
+			switch (options.scheduling) {
+			case Scheduling::BATCH: policy = SCHED_BATCH; break;
+			case Scheduling::IDLE:  policy = SCHED_IDLE; break;
+			case Scheduling::FIFO:
+				policy = SCHED_FIFO;
+				param.sched_priority = std::clamp(options.fifoPriority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+				break;
+			default: break;
+			}
+			// Real-time policies need CAP_SYS_NICE; unprivileged workers keep the default policy.
+			applied &= pthread_setschedparam(pthread_self(), policy, &param) == 0;
+		}
+
+		// Nice values are per thread on Linux. Raising priority (negative values) needs privileges.
+		if (options.nice != 0)
+			applied &= setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), options.nice) == 0;
+#else
+		(void)options;
+		(void)index;
+#endif
+		return applied;
+	}
+
+	std::vector<unsigned int> cpuOrder(const Threadpool::ThreadOptions& options) {
+		using Affinity = Threadpool::Affinity;
+		if (options.affinity == Affinity::NONE || options.affinity == Affinity::NUMA_NODES)
+			return {};
+		if (options.affinity == Affinity::EXPLICIT) {
+			if (options.cpus.empty())
+				throw std::invalid_argument("Affinity::EXPLICIT needs at least one CPU in ThreadOptions::cpus");
+			return options.cpus;
+		}
+
+		std::vector<RankedCpu> ranked = rankCpus(system_info::cpuTopology());
+		switch (options.affinity) {
+		case Affinity::COMPACT: // Fill each core, then each package, before moving on.
+			return orderBy(std::move(ranked), [](const RankedCpu& c) { return std::make_tuple(c.info.package, c.coreIndex, c.sibling); });
+		case Affinity::SCATTER: // Spread across packages, then cores, and only then onto hyperthreads.
+			return orderBy(std::move(ranked), [](const RankedCpu& c) { return std::make_tuple(c.sibling, c.coreIndex, c.info.package); });
+		case Affinity::PHYSICAL_CORES:
+			ranked.erase(std::remove_if(ranked.begin(), ranked.end(), [](const RankedCpu& c) { return c.sibling != 0; }), ranked.end());
+			return orderBy(std::move(ranked), [](const RankedCpu& c) { return std::make_tuple(c.info.package, c.coreIndex); });
+		default:
+			return {};
+		}
+	}
+
+	bool pinCurrentThread(const std::vector<unsigned int>& cpus) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int cpu : cpus) {
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+		}
+		return CPU_COUNT(&set) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpus;
+		return false;
+#endif
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Threadpool.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Applies Threadpool::ThreadOptions to worker threads.
+namespace thread_config {
+	// A joinable thread that, unlike std::thread, can be given a stack size. Must be joined before destruction.
+	class Thread {
+	public:
+		// stackSize 0 uses the platform default. Throws std::system_error if the thread can't be started.
+		Thread(std::function<void()> body, std::size_t stackSize);
+		~Thread();
+		Thread(Thread&&) noexcept;
+		Thread& operator=(Thread&&) noexcept;
+
+		void join();
+
+	private:
+		struct Handle;
+		std::unique_ptr<Handle> handle_;
+	};
+
+	/* Name the calling worker thread, and set its scheduling policy and nice value.
+	   Settings the process isn't privileged for are skipped. Returns false if any were. */
+	bool configureCurrentThread(const Threadpool::ThreadOptions& options, std::size_t index);
+
+	/* The CPU for each worker to be pinned to, by worker index modulo the size. Empty leaves workers unpinned.
+	   Throws std::invalid_argument for Affinity::EXPLICIT without any CPUs. */
+	std::vector<unsigned int> cpuOrder(const Threadpool::ThreadOptions& options);
+	// Restrict the calling thread to the given CPUs. Returns false if that isn't possible on this platform.
+	bool pinCurrentThread(const std::vector<unsigned int>& cpus);
+}
@@ -1,127 +1,1580 @@
 #include "Threadpool.hpp"
+#include "LatencyHistogram.hpp"
+#include "SystemInfo.hpp"
+#include "ThreadConfig.hpp"
 
-#include <queue>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <limits>
+
+namespace {
+	std::int64_t toNanos(Threadpool::clock::duration d) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	}
+
+	// Least CPU time, in nanoseconds, a job is charged for in fair scheduling, so that even jobs too short for the
+	// clock to measure cost their source something.
+	constexpr double MIN_JOB_COST = 1000;
+
+	// Most shards the count of running jobs is split into.
+	constexpr std::size_t MAX_WORKER_SHARDS = 64;
+
+	// Most jobs a worker takes from its queue at once, counting the one it starts right away.
+	constexpr std::size_t MAX_JOB_BATCH = 16;
+
+	// Estimated cost of a source's next job, from the moving average of its previous ones.
+	double jobCharge(double avgCost, double weight) {
+		return std::max(avgCost, MIN_JOB_COST) / weight;
+	}
+
+	double jobCost(std::chrono::nanoseconds cpuTime) {
+		return std::max(static_cast<double>(cpuTime.count()), MIN_JOB_COST);
+	}
+
+	// Corrects a source's pass and cost estimate once a job charged `charged` has actually used `cpuTime`.
+	void settleJob(double& pass, double& avgCost, double weight, double charged, std::chrono::nanoseconds cpuTime) {
+		const double cost = jobCost(cpuTime);
+		pass += cost / weight - charged;
+		avgCost += (cost - avgCost) / 8;
+	}
+
+	// The pool, node and worker slot the current thread works for, if it is a worker.
+	thread_local const Threadpool* current_pool = nullptr;
+	thread_local std::size_t current_node = 0;
+	thread_local std::size_t current_worker = 0;
+	thread_local int blocking_depth = 0;
+	// The trace buffer the current thread last recorded into, and the id of its pool.
+	thread_local std::uint64_t trace_pool = 0;
+	thread_local TraceBuffer* trace_buffer = nullptr;
+
+	// CPU time of jobs a worker has run from inside its current job, while waiting on a TaskGroup.
+	thread_local std::chrono::nanoseconds nested_cpu_time{0};
+}
 
 class Threadpool::JobQueue {
 public:
-	void push(std::unique_ptr<Job> job) {
-		std::lock_guard<std::mutex> lock{mutex_};
-		queue_.push(std::move(job));
+	explicit JobQueue(Threadpool& pool) : pool_(pool) {}
+
+	// Jobs are taken from the front: pushing there makes a job the next to run (LIFO), pushing at the back the last (FIFO).
+	void push(JobPtr job, bool front = false) {
+		ProfiledLock lock = _lock(LockSite::SUBMIT);
+		if (front)
+			queue_.push_front(std::move(job));
+		else
+			queue_.push_back(std::move(job));
 	}
-	std::unique_ptr<Job> getJob() {
-		std::lock_guard<std::mutex> latch{mutex_};
+	JobPtr getJob() {
+		ProfiledLock latch = _lock(LockSite::DEQUEUE);
 		if (queue_.empty())
 			return nullptr;
-		std::unique_ptr<Job> job = std::move(queue_.front());
-		queue_.pop();
+		JobPtr job = std::move(queue_.front());
+		queue_.pop_front();
 		return job;
 	}
-	void clear() {
-		std::lock_guard<std::mutex> lock{mutex_};
-		std::queue<std::unique_ptr<Job>>().swap(queue_);
+	// Moves up to max jobs from the front to out, but no more than the queue's size / parts, so the rest is left for
+	// the other workers. Returns the number of jobs taken.
+	std::size_t getJobs(JobPtr* out, std::size_t max, std::size_t parts) {
+		ProfiledLock latch = _lock(LockSite::DEQUEUE);
+		const std::size_t count = std::min(max, queue_.size() / std::max<std::size_t>(parts, 1));
+		for (std::size_t i = 0; i < count; ++i) {
+			out[i] = std::move(queue_.front());
+			queue_.pop_front();
+		}
+		return count;
+	}
+	// Cancels every queued job. Returns the number of jobs cancelled.
+	std::size_t clear() {
+		std::deque<JobPtr> cleared;
+		{
+			ProfiledLock lock = _lock(LockSite::OTHER);
+			cleared.swap(queue_);
+		}
+		const std::size_t count = cleared.size();
+		for (auto& job : cleared)
+			_cancel(std::move(job));
+		return count;
 	}
 
 	std::size_t size() const {
-		std::lock_guard<std::mutex> lock{mutex_};
+		ProfiledLock lock = _lock(LockSite::OTHER);
 		return queue_.size();
 	}
 
 	bool empty() const {
-		std::lock_guard<std::mutex> lock{mutex_};
+		ProfiledLock lock = _lock(LockSite::OTHER);
 		return queue_.empty();
 	}
 
+	/* How long the oldest pending job has been waiting (zero if there are none). That's the job at the back once
+	   jobs were pushed at the front; with both, the longer wait of the two ends. */
+	clock::duration headWaitTime(clock::time_point now) const {
+		ProfiledLock lock = _lock(LockSite::OTHER);
+		return queue_.empty() ? clock::duration::zero() : now - std::min(queue_.front()->enqueued_, queue_.back()->enqueued_);
+	}
+
 private:
-	std::queue<std::unique_ptr<Job>> queue_;
+	ProfiledLock _lock(LockSite site) const {
+		return ProfiledLock(mutex_, pool_._lock_counters(pool_.queue_lock_profile_, site));
+	}
+
+	Threadpool& pool_;
+	std::deque<JobPtr> queue_;
 	mutable std::mutex mutex_;
 };
 
+struct Threadpool::Node {
+	explicit Node(Threadpool& pool) : queue(pool) {}
+
+	JobQueue queue;
+	std::condition_variable task_cond;
+	// Workers of this node waiting on task_cond, and how many of those have already been notified. Guarded by mutex_.
+	thread_num waiting_threads = 0;
+	thread_num notified_threads = 0;
+
+	unsigned int id = 0;
+	std::vector<unsigned int> cpus;       // Workers of this node are restricted to these, if any.
+	std::vector<std::size_t> steal_order; // The other nodes, nearest first.
+};
+
+struct Threadpool::ExecutorQueue {
+	explicit ExecutorQueue(Threadpool& pool) : queue(pool) {}
+
+	JobQueue queue;
+	thread_num max_concurrency = 0;
+	// Guarded by mutex_.
+	double weight = 1;
+	double pass = 0;       // Stride scheduling position: advances by CPU time used / weight.
+	double avg_cost = 0;   // Moving average of job CPU time in nanoseconds, charged up front when a job is taken.
+	thread_num running = 0;
+	bool released = false; // The Executor handle is gone; remove once drained.
+	// When running last dropped below max_concurrency: until then its queued jobs waited on the limit, not on workers.
+	clock::time_point runnable_since;
+
+	std::uint64_t completed = 0;
+	std::chrono::nanoseconds cpu_time{0};
+
+	bool runnable() const { return (max_concurrency <= 0 || running < max_concurrency) && !queue.empty(); }
+};
+
+struct Threadpool::LatencyRecorder {
+	LatencyHistogram queue_wait;
+	LatencyHistogram run_time;
+
+	struct RecordedJob {
+		clock::time_point enqueued;
+		clock::duration queue_wait;
+		clock::duration run_time;
+		const char* label;
+	};
+	std::vector<RecordedJob> jobs;
+	std::mutex jobs_mutex; // Only contended while the jobs are being taken.
+};
+
+thread_local Threadpool::LatencyRecorder* Threadpool::current_recorder_ = nullptr;
+
+struct Threadpool::Worker {
+	thread_config::Thread thread;
+};
+
+struct alignas(Threadpool::CACHE_LINE_SIZE) Threadpool::WorkerShard {
+	std::atomic<thread_num> running{0};
+	std::atomic<Job*> lifo_slot{nullptr}; // Owned by the slot; taken by exchange.
+	std::atomic<std::int64_t> lifo_kept_ns{0}; // When the slot's job was added, in steady_clock nanoseconds.
+	std::atomic<std::uint64_t> completed{0};
+	std::atomic<std::int64_t> busy_ns{0};
+
+	/* Jobs taken from the queue along with the one being run, run next by the worker that took them. Stays
+	   counted as running meanwhile; parked workers steal from the back. */
+	std::mutex batch_mutex;
+	std::deque<JobPtr> batch; // Guarded by batch_mutex.
+	std::atomic<std::size_t> batched{0};    // batch.size(), to check without the lock.
+	std::atomic<std::int64_t> batch_held_ns{0}; // When the batch was last taken while empty, in steady_clock nanoseconds.
+
+	WorkerShard() = default;
+	~WorkerShard() {
+		// Workers run their kept and batched jobs before they exit; this is only a safety net.
+		if (Job* kept = lifo_slot.load(std::memory_order_relaxed))
+			_cancel(JobPtr(kept));
+		for (auto& job : batch)
+			_cancel(std::move(job));
+	}
+};
+
 Threadpool::Threadpool(thread_num initThreads, thread_num maxThreads, thread_num extendInc)
-	: job_queue_(std::make_unique<JobQueue>()), num_extend_(extendInc), max_threads_(maxThreads)
+	: Threadpool(initThreads, maxThreads, extendInc, ThreadOptions{})
+{}
+
+Threadpool::Threadpool(thread_num initThreads, thread_num maxThreads, thread_num extendInc, const ThreadOptions& options)
+	: num_extend_(extendInc),
+	  requested_threads_(initThreads), requested_max_threads_(maxThreads),
+	  thread_options_(options), cpu_order_(thread_config::cpuOrder(options)),
+	  growth_delay_ns_(toNanos(DEFAULT_GROWTH_DELAY)), spare_grace_ns_(toNanos(DEFAULT_SPARE_WORKER_GRACE))
 {
-	threads_.reserve(initThreads);
-	for (thread_num i = 0; i < initThreads; ++i)
-		threads_.emplace_back([this] { _run_thread(); });
+	std::vector<system_info::NodeInfo> numa;
+	if (options.affinity == Affinity::NUMA_NODES)
+		numa = system_info::numaTopology();
+	if (numa.empty())
+		numa.push_back({ 0, {}, {} });
+	for (std::size_t n = 0; n < numa.size(); ++n) {
+		auto node = std::make_unique<Node>(*this);
+		node->id = numa[n].id;
+		node->cpus = numa[n].cpus;
+		for (std::size_t other = 0; other < numa.size(); ++other) {
+			if (other != n)
+				node->steal_order.push_back(other);
+		}
+		const std::vector<int>& distances = numa[n].distances;
+		std::stable_sort(node->steal_order.begin(), node->steal_order.end(), [&distances](std::size_t a, std::size_t b) {
+			return a < distances.size() && b < distances.size() && distances[a] < distances[b];
+		});
+		for (unsigned int cpu : node->cpus) {
+			if (cpu_nodes_.size() <= cpu)
+				cpu_nodes_.resize(cpu + 1, 0);
+			cpu_nodes_[cpu] = n;
+		}
+		nodes_.push_back(std::move(node));
+	}
+
+	std::lock_guard<std::mutex> lock{workers_mutex_};
+	sized_cpus_ = _sizing_cpus();
+	initThreads = _apply_sizing();
+
+	// A shard per worker up to the larger of the initial size and the CPUs; workers beyond that share.
+	std::size_t shards = 1;
+	while (shards < MAX_WORKER_SHARDS && shards < static_cast<std::size_t>(std::max(initThreads, sized_cpus_)))
+		shards *= 2;
+	shards_ = std::make_unique<WorkerShard[]>(shards);
+	shard_mask_ = shards - 1;
+
+	workers_.reserve(std::max<thread_num>(initThreads, 0));
+	_add_threads(initThreads);
 }
 
 Threadpool::~Threadpool() {
+	shutdown(ShutdownMode::DRAIN);
+	_join_workers();
+}
+
+std::size_t Threadpool::shutdown(ShutdownMode mode, clock::time_point deadline) {
+	{
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::WAIT)};
+		accepting_ = false;
+		paused_ = false;
+	}
+	for (auto& node : nodes_)
+		node->task_cond.notify_all();
+
+	std::size_t cancelled = mode == ShutdownMode::DRAIN ? 0 : _cancel_pending_jobs();
+	bool finished = false;
+	if (mode != ShutdownMode::DISCARD) {
+		ProfiledLock latch{mutex_, _lock_counters(pool_lock_profile_, LockSite::WAIT)};
+		finished = latch.wait_until(finished_all_jobs_cond_, deadline, [this] {
+			return _finished_all_jobs();
+		});
+	}
+	cancelled += _cancel_pending_jobs();
+
 	{
-		std::lock_guard<std::mutex> lock{mutex_};
+		std::lock_guard<std::mutex> registry{workers_mutex_};
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::WAIT)};
 		should_finish_ = true;
 	}
-	task_cond_.notify_all();
+	for (auto& node : nodes_)
+		node->task_cond.notify_all();
+	_stop_growth_checks();
+	if (finished) // Nothing is running, so the workers are about to exit.
+		_join_workers();
+	return cancelled;
+}
+
+Threadpool::BlockingScope::BlockingScope(Threadpool& pool) {
+	if (current_pool != &pool)
+		return;
+	pool_ = &pool;
+	if (blocking_depth++ > 0)
+		return;
+	++pool.blocked_threads_;
+
+	// Jobs kept in this worker's LIFO slot or batch would wait out the block; queue them for other workers.
+	WorkerShard& shard = pool.shards_[current_worker & pool.shard_mask_];
+	JobPtr kept = pool._take_lifo_slot(shard);
+	if (kept || shard.batched.load(std::memory_order_relaxed) > 0) {
+		ProfiledLock lock{pool.mutex_, pool._lock_counters(pool.pool_lock_profile_, LockSite::OTHER)};
+		std::size_t requeued = pool._requeue_batch(shard, current_node);
+		if (kept) {
+			pool.nodes_[current_node]->queue.push(std::move(kept), true);
+			++requeued;
+		}
+		for (std::size_t i = 0; i < requeued && pool._wake_worker(current_node); ++i) {}
+	}
+
+	// Add a compensating worker if there are fewer than there are blocked threads (counting spares), and the limit allows.
+	std::lock_guard<std::mutex> registry{pool.workers_mutex_};
+	const thread_num compensating = pool.compensating_threads_;
+	if (pool.should_finish_ || compensating >= pool.blocked_threads_ || compensating >= pool.max_compensating_threads_)
+		return;
+	++pool.compensating_threads_;
+	pool._add_threads(1);
+}
+
+Threadpool::BlockingScope::~BlockingScope() {
+	if (pool_ == nullptr || --blocking_depth > 0)
+		return;
+	// The compensating worker this frees is kept as a spare for a while, then retires between jobs; see _retire_if_surplus.
+	pool_->spare_until_ns_.store(toNanos(clock::now().time_since_epoch()) + pool_->spare_grace_ns_.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	--pool_->blocked_threads_;
+}
+
+void Threadpool::pause() {
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	paused_ = true;
+	// Jobs kept in LIFO slots or batches would still run after their workers' current jobs; queue them with the rest.
+	for (std::size_t i = 0; i <= shard_mask_; ++i) {
+		_requeue_batch(shards_[i], i % nodes_.size());
+		if (JobPtr kept = _take_lifo_slot(shards_[i]))
+			nodes_[i % nodes_.size()]->queue.push(std::move(kept), true);
+	}
+}
+
+void Threadpool::resume() {
+	{
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+		paused_ = false;
+	}
+	for (auto& node : nodes_)
+		node->task_cond.notify_all();
+}
+
+bool Threadpool::isPaused() const {
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	return paused_;
+}
+
+void Threadpool::resize(thread_num numThreads) {
+	std::lock_guard<std::mutex> registry{workers_mutex_};
+	if (should_finish_)
+		return;
+	numThreads = std::max<thread_num>(numThreads, 0);
+	requested_threads_ = numThreads;
+	if (max_threads_ > 0 && numThreads > max_threads_)
+		requested_max_threads_ = numThreads;
+	_apply_sizing();
+	_resize(numThreads);
+}
+
+void Threadpool::setMaxThreads(thread_num maxThreads) {
+	std::lock_guard<std::mutex> registry{workers_mutex_};
+	if (should_finish_)
+		return;
+	requested_max_threads_ = std::max<thread_num>(maxThreads, 0);
+	_apply_sizing();
+	if (max_threads_ > 0 && num_threads_ - compensating_threads_ - retiring_threads_ > max_threads_)
+		_resize(max_threads_);
+}
 
-	for (auto& thread : threads_)
-		thread.join();
+void Threadpool::setDispatchOrder(DispatchOrder order) {
+	dispatch_order_.store(order, std::memory_order_relaxed);
+}
+
+void Threadpool::setExtendIncrement(thread_num extendIncr) {
+	num_extend_ = extendIncr;
 }
 
 void Threadpool::waitOnAllJobs() {
-	std::unique_lock<std::mutex> latch{mutex_};
-	finished_all_jobs_cond_.wait(latch, [this] {
-		return job_queue_->empty() && working_threads_ == 0;
+	ProfiledLock latch{mutex_, _lock_counters(pool_lock_profile_, LockSite::WAIT)};
+	latch.wait(finished_all_jobs_cond_, [this] {
+		return _finished_all_jobs();
 	});
 }
 
+bool Threadpool::waitOnAllJobs_for(clock::duration timeout) {
+	return waitOnAllJobs_until(clock::now() + timeout);
+}
+
+bool Threadpool::waitOnAllJobs_until(clock::time_point deadline) {
+	ProfiledLock latch{mutex_, _lock_counters(pool_lock_profile_, LockSite::WAIT)};
+	return latch.wait_until(finished_all_jobs_cond_, deadline, [this] {
+		return _finished_all_jobs();
+	});
+}
+
+void Threadpool::setIdleCallback(std::function<void()> callback) {
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	idle_callback_ = std::move(callback);
+}
+
 bool Threadpool::isIdle() const {
-	std::lock_guard<std::mutex> lock{mutex_};
-	return job_queue_->empty() && working_threads_ == 0;
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	return !_has_pending_jobs() && _working_threads() == 0;
 }
 
 void Threadpool::clearPendingJobs() {
-	job_queue_->clear();
+	_cancel_pending_jobs();
+}
+
+Threadpool::Executor Threadpool::makeExecutor(thread_num maxConcurrency, unsigned int weight) {
+	auto executor = std::make_shared<ExecutorQueue>(*this);
+	executor->max_concurrency = maxConcurrency;
+	executor->weight = std::max(weight, 1u);
+
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	executor->pass = virtual_time_;
+	executors_.push_back(executor);
+	return Executor(*this, std::move(executor));
+}
+
+void Threadpool::setGrowthDelay(std::chrono::microseconds delay) {
+	growth_delay_ns_ = toNanos(delay);
+}
+
+void Threadpool::setMaxCompensatingThreads(thread_num maxThreads) {
+	max_compensating_threads_ = maxThreads;
+}
+
+void Threadpool::setSpareWorkerGrace(std::chrono::microseconds grace) {
+	spare_grace_ns_ = toNanos(grace);
+}
+
+Threadpool::thread_num Threadpool::refreshSizing() {
+	const thread_num cpus = _sizing_cpus();
+
+	std::lock_guard<std::mutex> registry{workers_mutex_};
+	if (should_finish_)
+		return cpus;
+	sized_cpus_ = cpus;
+	const thread_num initThreads = _apply_sizing();
+	if (requested_threads_ == AUTO_THREADS)
+		_resize(initThreads);
+	return cpus;
+}
+
+Threadpool::Stats Threadpool::stats() const {
+	// Later stages first, so a job moving along while we read is never counted in a later stage but not an earlier one.
+	Stats stats{};
+	for (std::size_t i = 0; i <= shard_mask_; ++i) {
+		stats.completedJobs += shards_[i].completed.load(std::memory_order_relaxed);
+		stats.busyTime += std::chrono::nanoseconds(shards_[i].busy_ns.load(std::memory_order_relaxed));
+	}
+	const thread_num working = _working_threads();
+	const std::uint64_t finished = started_jobs_.load(std::memory_order_relaxed) + cancelled_jobs_.load(std::memory_order_relaxed);
+	stats.cancelledJobs = cancelled_jobs_.load(std::memory_order_relaxed);
+	stats.rejectedJobs = rejected_jobs_.load(std::memory_order_relaxed);
+	stats.inlineJobs = inline_jobs_.load(std::memory_order_relaxed);
+	stats.submittedJobs = submitted_jobs_.load(std::memory_order_relaxed);
+	stats.pendingJobs = static_cast<std::size_t>(stats.submittedJobs > finished ? stats.submittedJobs - finished : 0);
+
+	const thread_num threads = num_threads_;
+	stats.threads = static_cast<std::size_t>(std::max<thread_num>(threads, 0));
+	// A worker helping a TaskGroup runs a job inside its own, so there can be more jobs running than workers.
+	stats.busyThreads = std::min(static_cast<std::size_t>(std::max<thread_num>(working, 0)), stats.threads);
+	stats.idleThreads = stats.threads - stats.busyThreads;
+	return stats;
 }
 
 std::size_t Threadpool::numPendingJobs() const {
-	return job_queue_->size();
+	return stats().pendingJobs;
 }
 
 std::size_t Threadpool::numIdleThreads() const {
-	return threads_.size() - static_cast<std::size_t>(working_threads_);
+	const thread_num idle = num_threads_ - _working_threads();
+	return idle > 0 ? static_cast<std::size_t>(idle) : 0;
 }
 
 std::size_t Threadpool::numThreads() const {
-	return threads_.size();
+	return static_cast<std::size_t>(num_threads_);
+}
+
+std::size_t Threadpool::numBlockedThreads() const {
+	return static_cast<std::size_t>(blocked_threads_.load());
+}
+
+std::size_t Threadpool::numNodes() const {
+	return nodes_.size();
+}
+
+int Threadpool::currentWorkerIndex() const {
+	return current_pool == this ? static_cast<int>(current_worker) : -1;
+}
+
+void Threadpool::setLatencyTracking(bool enabled) {
+	track_latency_.store(enabled, std::memory_order_relaxed);
+}
+
+void Threadpool::setWorkloadRecording(bool enabled) {
+	record_workload_.store(enabled, std::memory_order_relaxed);
+}
+
+WorkloadTrace Threadpool::takeWorkloadTrace() {
+	std::vector<LatencyRecorder::RecordedJob> jobs;
+	{
+		std::lock_guard<std::mutex> lock{latency_mutex_};
+		for (const auto& recorder : latency_recorders_) {
+			if (!recorder)
+				continue;
+			std::lock_guard<std::mutex> jobsLock{recorder->jobs_mutex};
+			jobs.insert(jobs.end(), recorder->jobs.begin(), recorder->jobs.end());
+			recorder->jobs.clear();
+		}
+	}
+	std::stable_sort(jobs.begin(), jobs.end(), [](const auto& a, const auto& b) { return a.enqueued < b.enqueued; });
+
+	WorkloadTrace trace;
+	trace.jobs.reserve(jobs.size());
+	for (const auto& job : jobs) {
+		trace.jobs.push_back({ toNanos(job.enqueued - jobs.front().enqueued), toNanos(job.queue_wait),
+			toNanos(job.run_time), trace.labelIndex(job.label) });
+	}
+	return trace;
+}
+
+Threadpool::LatencyStats Threadpool::latencyStats() const {
+	LatencyHistogram::Counts queueWait{};
+	LatencyHistogram::Counts runTime{};
+	{
+		std::lock_guard<std::mutex> lock{latency_mutex_};
+		for (const auto& recorder : latency_recorders_) {
+			if (!recorder)
+				continue;
+			recorder->queue_wait.addTo(queueWait);
+			recorder->run_time.addTo(runTime);
+		}
+	}
+	const auto summarize = [](const LatencyHistogram::Counts& counts) {
+		return LatencySummary{ LatencyHistogram::total(counts),
+			LatencyHistogram::percentile(counts, 0.5), LatencyHistogram::percentile(counts, 0.9),
+			LatencyHistogram::percentile(counts, 0.99), LatencyHistogram::percentile(counts, 0.999),
+			LatencyHistogram::percentile(counts, 1) };
+	};
+	return { summarize(queueWait), summarize(runTime) };
+}
+
+void Threadpool::setTracing(bool enabled, std::size_t eventsPerThread) {
+	trace_events_.store(std::max<std::size_t>(eventsPerThread, 1), std::memory_order_relaxed);
+	tracing_.store(enabled, std::memory_order_relaxed);
+}
+
+void Threadpool::setLockProfiling(bool enabled) {
+	profile_locks_.store(enabled, std::memory_order_relaxed);
+}
+
+Threadpool::LockProfileStats Threadpool::lockStats() const {
+	LockProfileStats stats;
+	for (std::size_t site = 0; site < LOCK_SITES; ++site) {
+		stats.pool[site] = pool_lock_profile_.stats(static_cast<LockSite>(site));
+		stats.queues[site] = queue_lock_profile_.stats(static_cast<LockSite>(site));
+	}
+	return stats;
+}
+
+bool Threadpool::dumpTrace(const std::string& path) const {
+	std::ofstream out(path);
+	if (!out)
+		return false;
+	std::vector<const TraceBuffer*> buffers;
+	{
+		std::lock_guard<std::mutex> lock{trace_mutex_};
+		for (const auto& entry : trace_buffers_)
+			buffers.push_back(entry.second.get());
+		// Buffers are never removed while the pool lives, so they can be read after unlocking.
+	}
+	TraceBuffer::writeChromeTrace(out, buffers);
+	return static_cast<bool>(out.flush());
+}
+
+void Threadpool::_add(JobPtr job, std::size_t node) {
+	_add(std::move(job), node, dispatch_order_.load(std::memory_order_relaxed));
+}
+
+void Threadpool::_add(JobPtr job, std::size_t node, DispatchOrder order) {
+	_add(std::move(job), node, order, std::nullopt);
+}
+
+Threadpool::JobPtr Threadpool::_add(JobPtr job, std::size_t node, DispatchOrder order, std::optional<clock::duration> maxWait) {
+	if (node >= nodes_.size())
+		node = _current_node();
+	job->enqueued_ = clock::now();
+
+	bool grow = false;
+	{
+		// Push under the pool lock so a worker can't miss the wakeup between checking the queues and waiting.
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::SUBMIT)};
+		if (accepting_) {
+			// Decide under the same lock, so the job joins the queue the prediction was made for.
+			if (maxWait && _should_run_inline(*maxWait)) {
+				inline_jobs_.fetch_add(1, std::memory_order_relaxed);
+				return job;
+			}
+			submitted_jobs_.fetch_add(1, std::memory_order_relaxed);
+			/* Keep the job for this worker to run next, unless a parked worker could start it right away; the job
+			   it replaces is queued. Slots are per shard, so once workers outnumber shards they share them, and one
+			   may run a job another kept. Idle workers take kept jobs before waiting, and workers between jobs take
+			   overdue ones before queued jobs (see _take_kept): a job blocking on a job it kept waits for another
+			   worker's current job at most. A TaskGroup wait or BlockingScope runs or queues it right away. */
+			if (order == DispatchOrder::LIFO_SLOT && current_pool == this && !paused_ && !_has_idle_worker()) {
+				lifo_slots_used_.store(true, std::memory_order_relaxed);
+				WorkerShard& shard = shards_[current_worker & shard_mask_];
+				shard.lifo_kept_ns.store(toNanos(job->enqueued_.time_since_epoch()), std::memory_order_relaxed);
+				job.reset(shard.lifo_slot.exchange(job.release(), std::memory_order_acq_rel)); // The job it replaces, if any.
+			}
+			if (job) {
+				nodes_[node]->queue.push(std::move(job), order == DispatchOrder::LIFO);
+				// Only grow when no parked worker could be woken for the job.
+				grow = !_wake_worker(node);
+			}
+		} else {
+			rejected_jobs_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	if (job) {
+		_cancel(std::move(job));
+		return nullptr;
+	}
+	if (grow)
+		_grow_or_recheck();
+	return nullptr;
+}
+
+void Threadpool::_add_to_executor(JobPtr job, ExecutorQueue& executor) {
+	job->enqueued_ = clock::now();
+	job->executor_ = &executor;
+	bool grow = false;
+	{
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::SUBMIT)};
+		if (accepting_) {
+			executor.queue.push(std::move(job));
+			submitted_jobs_.fetch_add(1, std::memory_order_relaxed);
+			++executor_jobs_;
+			// A job beyond the executor's concurrency limit is picked up when one of its running jobs finishes.
+			if (executor.runnable())
+				grow = !_wake_worker(_current_node());
+		} else {
+			rejected_jobs_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	if (job) {
+		_cancel(std::move(job));
+		return;
+	}
+	if (grow)
+		_grow_or_recheck();
+}
+
+void Threadpool::_release_executor(ExecutorQueue& executor) {
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	executor.released = true;
+	if (executor.running == 0 && executor.queue.empty()) {
+		executors_.erase(std::find_if(executors_.begin(), executors_.end(), [&executor](const auto& e) {
+			return e.get() == &executor;
+		}));
+	}
+}
+
+bool Threadpool::_wake_worker(std::size_t node) {
+	// Caller must hold mutex_. Prefer a worker on the given node, then the nearest node with a worker to spare.
+	// Returns whether a parked worker was woken.
+	auto canWake = [](const Node& n) { return n.waiting_threads > n.notified_threads; };
+	Node* wake = nullptr;
+	if (canWake(*nodes_[node])) {
+		wake = nodes_[node].get();
+	} else {
+		for (std::size_t other : nodes_[node]->steal_order) {
+			if (canWake(*nodes_[other])) {
+				wake = nodes_[other].get();
+				break;
+			}
+		}
+	}
+	if (wake) {
+		++wake->notified_threads;
+		wake->task_cond.notify_one();
+	}
+	return wake != nullptr;
+}
+
+bool Threadpool::_has_idle_worker() const {
+	// Caller must hold mutex_. Whether a parked worker is free to be woken.
+	return std::any_of(nodes_.begin(), nodes_.end(), [](const auto& n) { return n->waiting_threads > n->notified_threads; });
+}
+
+bool Threadpool::_should_run_inline(clock::duration maxWait) const {
+	// Caller must hold mutex_. Predicts the queue wait of a job added now: workers not running a job take the first
+	// queued jobs right away; otherwise each worker finishes its current job, then the rest are shared between
+	// them, all at the average job's CPU time.
+	if (paused_)
+		return true;
+	std::size_t queued = _pending_jobs();
+	for (std::size_t i = 0; batches_used_.load(std::memory_order_relaxed) && i <= shard_mask_; ++i)
+		queued += shards_[i].batched.load(std::memory_order_relaxed);
+	const thread_num threads = num_threads_;
+	const std::size_t free = static_cast<std::size_t>(std::max<thread_num>(threads - _working_threads(), 0));
+	if (queued < free)
+		return false;
+	const double avgCost = std::max(pool_avg_cost_.load(std::memory_order_relaxed), MIN_JOB_COST);
+	const double predicted = avgCost * (1 + static_cast<double>(queued - free) / static_cast<double>(std::max<thread_num>(threads, 1)));
+	return predicted > static_cast<double>(toNanos(maxWait));
+}
+
+std::size_t Threadpool::_node_index(unsigned int node) const {
+	for (std::size_t i = 0; i < nodes_.size(); ++i) {
+		if (nodes_[i]->id == node)
+			return i;
+	}
+	return CURRENT_NODE;
+}
+
+std::size_t Threadpool::_current_node() const {
+	if (nodes_.size() == 1)
+		return 0;
+	if (current_pool == this)
+		return current_node;
+	const int cpu = system_info::currentCpu();
+	return cpu >= 0 && static_cast<std::size_t>(cpu) < cpu_nodes_.size() ? cpu_nodes_[cpu] : 0;
+}
+
+bool Threadpool::_has_pending_jobs() const {
+	// Caller must hold mutex_. Only counts executor jobs that their concurrency limit lets run now.
+	for (const auto& node : nodes_) {
+		if (!node->queue.empty())
+			return true;
+	}
+	return std::any_of(executors_.begin(), executors_.end(), [](const auto& executor) { return executor->runnable(); });
+}
+
+Threadpool::thread_num Threadpool::_working_threads() const {
+	// Acquire pairs with the release when a job's count is dropped, so a caller seeing 0 sees the jobs' effects.
+	thread_num working = 0;
+	for (std::size_t i = 0; i <= shard_mask_; ++i)
+		working += shards_[i].running.load(std::memory_order_acquire);
+	return working;
+}
+
+std::size_t Threadpool::_pending_jobs() const {
+	std::size_t pending = executor_jobs_;
+	for (const auto& node : nodes_)
+		pending += node->queue.size();
+	return pending;
+}
+
+Threadpool::JobPtr Threadpool::_take_job(std::size_t node, WorkerShard* batch) {
+	// Caller must hold mutex_. Stride scheduling: take from the source furthest behind its share, where the pool's
+	// own queues count as one source of weight 1. Sources that were idle rejoin at the current virtual time.
+	// Given a batch, more jobs of the node's queue may be moved there for the caller to run next.
+	ExecutorQueue* chosen = nullptr;
+	double pass = 0;
+	pool_pass_ += static_cast<double>(pool_pass_correction_.exchange(0, std::memory_order_relaxed));
+	bool poolPending = _pending_jobs() > executor_jobs_;
+	if (poolPending) {
+		pool_pass_ = std::max(pool_pass_, virtual_time_);
+		pass = pool_pass_;
+	}
+	for (auto& executor : executors_) {
+		if (!executor->runnable())
+			continue;
+		executor->pass = std::max(executor->pass, virtual_time_);
+		if ((!poolPending && !chosen) || executor->pass < pass) {
+			chosen = executor.get();
+			pass = executor->pass;
+		}
+	}
+
+	// Charge the expected cost now, so concurrent workers don't all pick the same source before any job finishes.
+	if (chosen) {
+		JobPtr job = chosen->queue.getJob();
+		if (!job)
+			return nullptr;
+		virtual_time_ = chosen->pass;
+		idle_reported_ = false;
+		started_jobs_.fetch_add(1, std::memory_order_relaxed);
+		job->charged_ = jobCharge(chosen->avg_cost, chosen->weight);
+		job->ready_ = std::max(job->enqueued_, chosen->runnable_since);
+		chosen->pass += job->charged_;
+		++chosen->running;
+		--executor_jobs_;
+		return job;
+	}
+
+	JobPtr job = nodes_[node]->queue.getJob();
+	for (std::size_t i = 0; !job && i < nodes_[node]->steal_order.size(); ++i) {
+		Node& victim = *nodes_[nodes_[node]->steal_order[i]];
+		job = victim.queue.getJob();
+		if (job)
+			_trace(TraceEvent::STEAL, nullptr, victim.id);
+	}
+	if (!job)
+		return nullptr;
+	virtual_time_ = pool_pass_;
+	idle_reported_ = false;
+	started_jobs_.fetch_add(1, std::memory_order_relaxed);
+	job->charged_ = jobCharge(pool_avg_cost_.load(std::memory_order_relaxed), 1);
+	pool_pass_ += job->charged_;
+
+	// Take more only while there are enough queued jobs for every worker to get as many, so batches don't
+	// unbalance the workers; they are started (and counted as such) one at a time.
+	if (batch) {
+		JobPtr taken[MAX_JOB_BATCH - 1];
+		const std::size_t workers = static_cast<std::size_t>(std::max<thread_num>(num_threads_, 1));
+		const std::size_t count = nodes_[node]->queue.getJobs(taken, MAX_JOB_BATCH - 1, workers);
+		if (count > 0) {
+			batches_used_.store(true, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> lock{batch->batch_mutex};
+			if (batch->batch.empty())
+				batch->batch_held_ns.store(toNanos(clock::now().time_since_epoch()), std::memory_order_relaxed);
+			for (std::size_t i = 0; i < count; ++i) {
+				taken[i]->charged_ = job->charged_;
+				pool_pass_ += job->charged_;
+				batch->batch.push_back(std::move(taken[i]));
+			}
+			batch->batched.store(batch->batch.size(), std::memory_order_relaxed);
+		}
+	}
+	return job;
+}
+
+void Threadpool::_finish_job(ExecutorQueue* executor, double charged, std::chrono::nanoseconds cpuTime) {
+	if (!executor) {
+		// Settled without mutex_: the next _take_job applies the correction to pool_pass_. Racing updates to the
+		// average may drop a sample, which an estimate can afford.
+		const double cost = jobCost(cpuTime);
+		pool_pass_correction_.fetch_add(static_cast<std::int64_t>(cost - charged), std::memory_order_relaxed);
+		const double avgCost = pool_avg_cost_.load(std::memory_order_relaxed);
+		pool_avg_cost_.store(avgCost + (cost - avgCost) / 8, std::memory_order_relaxed);
+		return;
+	}
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::COMPLETION)};
+	settleJob(executor->pass, executor->avg_cost, executor->weight, charged, cpuTime);
+	++executor->completed;
+	executor->cpu_time += cpuTime;
+	if (executor->running-- == executor->max_concurrency)
+		executor->runnable_since = clock::now();
+	if (executor->released && executor->running == 0 && executor->queue.empty()) {
+		executors_.erase(std::find_if(executors_.begin(), executors_.end(), [executor](const auto& e) {
+			return e.get() == executor;
+		}));
+	}
+}
+
+bool Threadpool::_finished_all_jobs() const {
+	// Caller must hold mutex_. Also waits for the pool to have reported going idle and for its idle callbacks to
+	// return, so that waiting on all jobs covers the callback too.
+	return idle_reported_ && idle_callbacks_running_ == 0 && !_has_pending_jobs() && _working_threads() == 0;
+}
+
+void Threadpool::_notify_if_idle() {
+	// Called once workers see the last job finished, or queues are cleared; waiters check the same condition under mutex_.
+	std::function<void()> callback;
+	{
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::COMPLETION)};
+		if (_has_pending_jobs() || _working_threads() != 0)
+			return;
+		if (!idle_reported_) {
+			idle_reported_ = true;
+			callback = idle_callback_;
+			if (callback)
+				++idle_callbacks_running_;
+		}
+	}
+	if (callback) {
+		callback();
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::COMPLETION)};
+		--idle_callbacks_running_;
+	}
+	finished_all_jobs_cond_.notify_all();
+}
+
+std::size_t Threadpool::_cancel_pending_jobs() {
+	std::size_t cancelled = 0;
+	for (auto& node : nodes_)
+		cancelled += node->queue.clear();
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+	for (auto& executor : executors_) {
+		const std::size_t cleared = executor->queue.clear();
+		executor_jobs_ -= cleared;
+		cancelled += cleared;
+	}
+	lock.unlock();
+	for (std::size_t i = 0; i <= shard_mask_; ++i) {
+		if (JobPtr kept = _take_lifo_slot(shards_[i])) {
+			_cancel(std::move(kept));
+			++cancelled;
+		}
+		while (JobPtr batched = _take_batched(shards_[i])) {
+			_cancel(std::move(batched));
+			++cancelled;
+		}
+	}
+	cancelled_jobs_.fetch_add(cancelled, std::memory_order_relaxed);
+	if (cancelled > 0)
+		_notify_if_idle();
+	return cancelled;
+}
+
+void Threadpool::_cancel(JobPtr job) {
+	// Jobs the pool doesn't own may be gone once cancelled, so decide whether to delete beforehand.
+	Job* cancelled = job.release();
+	const bool owned = cancelled->owned_;
+	cancelled->cancel();
+	if (owned)
+		delete cancelled;
+}
+
+Threadpool::JobPtr Threadpool::_take_lifo_slot(WorkerShard& shard) {
+	if (!lifo_slots_used_.load(std::memory_order_relaxed) || !shard.lifo_slot.load(std::memory_order_relaxed))
+		return nullptr;
+	return JobPtr(shard.lifo_slot.exchange(nullptr, std::memory_order_acq_rel));
+}
+
+Threadpool::JobPtr Threadpool::_take_batched(WorkerShard& shard, bool newest) {
+	// The worker that took the batch runs its jobs oldest first; others steal the newest.
+	if (shard.batched.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+	std::lock_guard<std::mutex> lock{shard.batch_mutex};
+	if (shard.batch.empty())
+		return nullptr;
+	JobPtr job;
+	if (newest) {
+		job = std::move(shard.batch.back());
+		shard.batch.pop_back();
+	} else {
+		job = std::move(shard.batch.front());
+		shard.batch.pop_front();
+	}
+	shard.batched.store(shard.batch.size(), std::memory_order_relaxed);
+	return job;
+}
+
+Threadpool::JobPtr Threadpool::_take_kept(std::size_t first, bool overdueOnly) {
+	/* Takes a job kept in a LIFO slot or batch, looking at shards from the given one on. With overdueOnly, only one
+	   kept for longer than the growth delay: its worker may be blocked waiting on it, and the others would
+	   otherwise only get to it once nothing else is queued. Overdue batched jobs are taken oldest first. */
+	const bool slots = lifo_slots_used_.load(std::memory_order_relaxed);
+	const bool batches = batches_used_.load(std::memory_order_relaxed);
+	if (!slots && !batches)
+		return nullptr;
+	const std::int64_t overdue = overdueOnly
+		? toNanos(clock::now().time_since_epoch()) - growth_delay_ns_.load(std::memory_order_relaxed)
+		: std::numeric_limits<std::int64_t>::max();
+	for (std::size_t i = 0; i <= shard_mask_; ++i) {
+		WorkerShard& victim = shards_[(first + i) & shard_mask_];
+		JobPtr kept;
+		if (slots && victim.lifo_kept_ns.load(std::memory_order_relaxed) <= overdue)
+			kept = _take_lifo_slot(victim);
+		if (!kept && batches && victim.batch_held_ns.load(std::memory_order_relaxed) <= overdue)
+			kept = _take_batched(victim, !overdueOnly);
+		if (kept)
+			return kept;
+	}
+	return nullptr;
+}
+
+std::size_t Threadpool::_requeue_batch(WorkerShard& shard, std::size_t node) {
+	// Caller must hold mutex_. Puts a batch back at the front of the node's queue, in its order.
+	if (shard.batched.load(std::memory_order_relaxed) == 0)
+		return 0;
+	std::lock_guard<std::mutex> lock{shard.batch_mutex};
+	const std::size_t count = shard.batch.size();
+	for (auto job = shard.batch.rbegin(); job != shard.batch.rend(); ++job)
+		nodes_[node]->queue.push(std::move(*job), true);
+	shard.batch.clear();
+	shard.batched.store(0, std::memory_order_relaxed);
+	return count;
+}
+
+void Threadpool::_join_workers() {
+	std::vector<std::unique_ptr<Worker>> workers;
+	{
+		std::lock_guard<std::mutex> registry{workers_mutex_};
+		workers.swap(workers_);
+		_reap_retired();
+	}
+	for (auto& worker : workers) {
+		if (worker) {
+			worker->thread.join();
+			--num_threads_;
+		}
+	}
+	// Nothing is left to compensate for or to retire.
+	std::lock_guard<std::mutex> registry{workers_mutex_};
+	compensating_threads_ = 0;
+	retiring_threads_ = 0;
+}
+
+Threadpool::LatencyRecorder& Threadpool::_latency_recorder() {
+	// Only the first job a worker records takes the lock.
+	if (!current_recorder_) {
+		std::lock_guard<std::mutex> lock{latency_mutex_};
+		if (latency_recorders_.size() <= current_worker)
+			latency_recorders_.resize(current_worker + 1);
+		if (!latency_recorders_[current_worker])
+			latency_recorders_[current_worker] = std::make_unique<LatencyRecorder>();
+		current_recorder_ = latency_recorders_[current_worker].get();
+	}
+	return *current_recorder_;
 }
 
-void Threadpool::_add(std::unique_ptr<Job> job) {
-	job_queue_->push(std::move(job));
-	task_cond_.notify_one();
-	if (working_threads_ == static_cast<thread_num>(threads_.size()))
-		_extend();
+void Threadpool::_record_trace(TraceEvent type, const char* label, std::uint32_t arg) {
+	// Only the first event a thread records in this pool (since it last recorded in another) takes the lock.
+	if (trace_pool != id_) {
+		const std::thread::id self = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock{trace_mutex_};
+		auto entry = std::find_if(trace_buffers_.begin(), trace_buffers_.end(), [self](const auto& e) { return e.first == self; });
+		if (entry == trace_buffers_.end()) {
+			std::string name;
+			if (current_pool == this)
+				name = (thread_options_.namePrefix.empty() ? "worker " : thread_options_.namePrefix) + std::to_string(current_worker);
+			else
+				name = "thread " + std::to_string(trace_buffers_.size());
+			trace_buffers_.emplace_back(self, std::make_unique<TraceBuffer>(trace_events_.load(std::memory_order_relaxed), std::move(name)));
+			entry = std::prev(trace_buffers_.end());
+		}
+		trace_pool = id_;
+		trace_buffer = entry->second.get();
+	}
+	trace_buffer->record(toNanos(clock::now().time_since_epoch()), type, label, arg);
+}
+
+std::uint64_t Threadpool::_next_id() {
+	static std::atomic<std::uint64_t> next{1};
+	return next++;
+}
+
+void Threadpool::_record_queue_wait(clock::duration wait) {
+	// Exponentially weighted moving average; racing updates may drop a sample, which is fine for a trend.
+	const std::int64_t sample = toNanos(wait);
+	const std::int64_t avg = avg_queue_wait_ns_.load(std::memory_order_relaxed);
+	avg_queue_wait_ns_.store(avg + (sample - avg) / 8, std::memory_order_relaxed);
+}
+
+bool Threadpool::_has_live_worker() const {
+	// Whether a worker could still take queued jobs: one that isn't blocked in a BlockingScope or about to retire.
+	return num_threads_ - retiring_threads_ > blocked_threads_;
+}
+
+bool Threadpool::_should_extend() {
+	if (num_extend_ <= 0)
+		return false;
+	// With no worker to run them (none started yet, or all blocked), queued jobs would wait forever: grow right away.
+	if (!_has_live_worker())
+		return true;
+	// Otherwise only grow while every worker is busy: a queued job that didn't wake a worker may be waiting on its
+	// executor's limit, or for a worker that is between jobs.
+	if (_working_threads() < num_threads_)
+		return false;
+
+	/* Jobs waiting in batches and LIFO slots count too: a worker stuck on a long job holds them up. Jobs of
+	   executors at their concurrency limit don't: they wait on their own limit, which more workers wouldn't help.
+	   Their head waits count from when they became runnable. */
+	const clock::time_point now = clock::now();
+	std::size_t backlog = 0;
+	clock::duration headWait = clock::duration::zero();
+	for (const auto& node : nodes_)
+		backlog += node->queue.size();
+	const bool batches = batches_used_.load(std::memory_order_relaxed);
+	const bool slots = lifo_slots_used_.load(std::memory_order_relaxed);
+	for (std::size_t i = 0; (batches || slots) && i <= shard_mask_; ++i) {
+		const WorkerShard& shard = shards_[i];
+		backlog += shard.batched.load(std::memory_order_relaxed);
+		if (slots && shard.lifo_slot.load(std::memory_order_relaxed)) {
+			++backlog;
+			headWait = std::max(headWait, now - clock::time_point(std::chrono::nanoseconds(shard.lifo_kept_ns.load(std::memory_order_relaxed))));
+		}
+	}
+	if (executor_jobs_ > 0) {
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+		for (const auto& executor : executors_) {
+			if (paused_ || !executor->runnable())
+				continue;
+			backlog += executor->queue.size();
+			headWait = std::max(headWait, std::min(executor->queue.headWaitTime(now), now - executor->runnable_since));
+		}
+	}
+	const std::size_t previousBacklog = last_backlog_.exchange(backlog, std::memory_order_relaxed);
+	if (backlog == 0 || backlog < previousBacklog)
+		return false; // The workers are keeping up.
+
+	const std::int64_t delay = growth_delay_ns_.load(std::memory_order_relaxed);
+	if (toNanos(now.time_since_epoch()) - last_extend_ns_.load(std::memory_order_relaxed) < delay)
+		return false;
+
+	// Grow only once jobs have been kept waiting, either right now or on average recently.
+	for (const auto& node : nodes_)
+		headWait = std::max(headWait, node->queue.headWaitTime(now));
+	for (std::size_t i = 0; batches && i <= shard_mask_; ++i) {
+		WorkerShard& shard = shards_[i];
+		if (shard.batched.load(std::memory_order_relaxed) == 0)
+			continue;
+		std::lock_guard<std::mutex> lock{shard.batch_mutex};
+		if (!shard.batch.empty())
+			headWait = std::max(headWait, now - shard.batch.front()->enqueued_);
+	}
+	return toNanos(headWait) >= delay || avg_queue_wait_ns_.load(std::memory_order_relaxed) >= delay;
 }
 
 Threadpool::thread_num Threadpool::_extend() {
+	std::lock_guard<std::mutex> registry{workers_mutex_};
 	if (should_finish_ || num_extend_ <= 0)
 		return 0;
 
-	const thread_num currentSize = static_cast<thread_num>(threads_.size());
-	const thread_num targetSize = max_threads_ <= 0 ? currentSize + num_extend_ : std::min(currentSize + num_extend_, max_threads_);
+	// Re-check the rate limit under the lock so racing callers only extend once; without a live worker, grow anyway.
+	const std::int64_t now = toNanos(clock::now().time_since_epoch());
+	if (_has_live_worker() && now - last_extend_ns_.load(std::memory_order_relaxed) < growth_delay_ns_.load(std::memory_order_relaxed))
+		return 0;
+
+	const thread_num currentSize = num_threads_ - compensating_threads_ - retiring_threads_;
+	const thread_num targetSize = max_threads_ <= 0 ? currentSize + num_extend_ : std::max(currentSize, std::min<thread_num>(currentSize + num_extend_, max_threads_));
 	const thread_num sizeIncrease = targetSize - currentSize;
 
-	for (thread_num i = 0; i < sizeIncrease; ++i)
-		threads_.emplace_back([this] { _run_thread(); });
+	_add_threads(sizeIncrease);
+	last_extend_ns_.store(now, std::memory_order_relaxed);
+	if (sizeIncrease > 0)
+		_trace(TraceEvent::EXTEND, nullptr, static_cast<std::uint32_t>(sizeIncrease));
 
 	return sizeIncrease;
 }
 
-void Threadpool::_run_thread() {
+void Threadpool::_grow_or_recheck() {
+	// Called once a job was queued without waking a worker. If it's too soon to tell whether the pool should grow,
+	// check again later: no further submission or dequeue may come to do it, e.g. when the pool's only worker
+	// is blocked on the job.
+	if (!_should_extend() || _extend() == 0)
+		_schedule_growth_check();
+}
+
+void Threadpool::_schedule_growth_check() {
+	// A check is due once the queued jobs have waited for the growth delay. An earlier one already pending covers them.
+	if (num_extend_ <= 0 || growth_check_ns_.load(std::memory_order_relaxed) != 0)
+		return;
+	std::lock_guard<std::mutex> lock{growth_mutex_};
+	if (growth_stop_ || growth_check_ns_.load(std::memory_order_relaxed) != 0)
+		return;
+	growth_check_ns_.store(toNanos(clock::now().time_since_epoch()) + growth_delay_ns_.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	if (growth_thread_.joinable())
+		growth_cond_.notify_one();
+	else
+		growth_thread_ = std::thread([this] { _run_growth_checks(); });
+}
+
+void Threadpool::_run_growth_checks() {
+	std::unique_lock<std::mutex> lock{growth_mutex_};
+	while (!growth_stop_) {
+		const std::int64_t due = growth_check_ns_.load(std::memory_order_relaxed);
+		if (due == 0) {
+			growth_cond_.wait(lock);
+			continue;
+		}
+		if (toNanos(clock::now().time_since_epoch()) < due) {
+			growth_cond_.wait_until(lock, clock::time_point(std::chrono::nanoseconds(due)));
+			continue;
+		}
+		// Cleared before checking, so jobs queued meanwhile schedule a check of their own.
+		growth_check_ns_.store(0, std::memory_order_relaxed);
+		lock.unlock();
+		if (_should_extend())
+			_extend();
+
+		// Keep checking while jobs are still queued behind busy workers, and the pool may still grow.
+		bool again = _working_threads() >= num_threads_ && last_backlog_.load(std::memory_order_relaxed) > 0;
+		if (again) {
+			std::lock_guard<std::mutex> registry{workers_mutex_};
+			const thread_num currentSize = num_threads_ - compensating_threads_ - retiring_threads_;
+			again = !should_finish_ && (max_threads_ <= 0 || currentSize < max_threads_);
+		}
+		lock.lock();
+		if (again && growth_check_ns_.load(std::memory_order_relaxed) == 0) {
+			growth_check_ns_.store(toNanos(clock::now().time_since_epoch()) + growth_delay_ns_.load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+		}
+	}
+}
+
+void Threadpool::_stop_growth_checks() {
+	std::thread checker;
+	{
+		std::lock_guard<std::mutex> lock{growth_mutex_};
+		growth_stop_ = true;
+		checker.swap(growth_thread_);
+	}
+	growth_cond_.notify_all();
+	if (checker.joinable())
+		checker.join();
+}
+
+Threadpool::thread_num Threadpool::_sizing_cpus() const {
+	// With Affinity::PHYSICAL_CORES, AUTO_THREADS sizes go by the cores workers are pinned to.
+	thread_num cpus = static_cast<thread_num>(system_info::availableCpus());
+	if (thread_options_.affinity == Affinity::PHYSICAL_CORES && !cpu_order_.empty())
+		cpus = std::min(cpus, static_cast<thread_num>(cpu_order_.size()));
+	return cpus;
+}
+
+Threadpool::thread_num Threadpool::_apply_sizing() {
+	// Caller must hold workers_mutex_. Sets the max threads from the sizes asked for and sized_cpus_, the same way
+	// whenever either changes. Returns the initial size that goes with them.
+	const thread_num initThreads = requested_threads_ == AUTO_THREADS ? sized_cpus_ : requested_threads_;
+	max_threads_ = requested_max_threads_ == AUTO_THREADS ? std::max(initThreads, sized_cpus_) : requested_max_threads_;
+	return initThreads;
+}
+
+void Threadpool::_add_threads(thread_num count) {
+	// Caller must hold workers_mutex_.
+	_reap_retired();
+	std::size_t index = 0;
+	for (thread_num i = 0; i < count; ++i) {
+		while (index < workers_.size() && workers_[index])
+			++index;
+		if (index == workers_.size())
+			workers_.emplace_back();
+		// Counted before it starts, so the pool never sees it run a job without counting it as live.
+		++num_threads_;
+		try {
+			workers_[index] = std::make_unique<Worker>(Worker{ thread_config::Thread([this, index] {
+				_init_thread(index);
+				_run_thread(index);
+			}, thread_options_.stackSize) });
+		} catch (...) {
+			--num_threads_;
+			throw;
+		}
+	}
+}
+
+void Threadpool::_resize(thread_num numThreads) {
+	// Caller must hold workers_mutex_. Cancel pending retirements before adding threads.
+	const thread_num currentSize = num_threads_ - compensating_threads_ - retiring_threads_;
+	if (numThreads > currentSize) {
+		const thread_num cancelled = std::min<thread_num>(retiring_threads_, numThreads - currentSize);
+		retiring_threads_ -= cancelled;
+		_add_threads(numThreads - currentSize - cancelled);
+	} else if (numThreads < currentSize) {
+		retiring_threads_ += currentSize - numThreads;
+		// Wake idle workers so they notice; busy ones retire after their current job.
+		ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::OTHER)};
+		for (auto& node : nodes_)
+			node->task_cond.notify_all();
+	}
+}
+
+void Threadpool::_reap_retired() {
+	// Caller must hold workers_mutex_. Retired workers have nothing left to do but return, so joining is quick.
+	for (auto& worker : retired_)
+		worker->thread.join();
+	retired_.clear();
+}
+
+void Threadpool::_init_thread(std::size_t index) {
+	current_pool = this;
+	current_node = index % nodes_.size();
+	current_worker = index;
+	if (!nodes_[current_node]->cpus.empty())
+		thread_config::pinCurrentThread(nodes_[current_node]->cpus);
+	else if (!cpu_order_.empty())
+		thread_config::pinCurrentThread({ cpu_order_[index % cpu_order_.size()] });
+	thread_config::configureCurrentThread(thread_options_, index);
+}
+
+bool Threadpool::_surplus_threads() const {
+	return retiring_threads_ > 0 || compensating_threads_ > blocked_threads_;
+}
+
+bool Threadpool::_spare_expired() const {
+	return toNanos(clock::now().time_since_epoch()) >= spare_until_ns_.load(std::memory_order_relaxed);
+}
+
+bool Threadpool::_retire_if_surplus(std::size_t index) {
+	/* Retire if the pool was shrunk, or for each blocked region that has ended once the spares' grace period is
+	   over. Any worker may be the one to go. */
+	if (!_surplus_threads() || (retiring_threads_ == 0 && !_spare_expired()))
+		return false;
+
+	std::lock_guard<std::mutex> registry{workers_mutex_};
+	if (should_finish_) // The destructor owns the workers now; just finish normally.
+		return false;
+	if (retiring_threads_ > 0)
+		--retiring_threads_;
+	else if (compensating_threads_ > blocked_threads_ && _spare_expired())
+		--compensating_threads_;
+	else
+		return false;
+	retired_.push_back(std::move(workers_[index]));
+	--num_threads_;
+
+	// This worker may have been woken for a job; pass it on.
+	ProfiledLock lock{mutex_, _lock_counters(pool_lock_profile_, LockSite::DEQUEUE)};
+	if (_has_pending_jobs() && !paused_)
+		_wake_worker(current_node);
+	return true;
+}
+
+void Threadpool::_run_thread(std::size_t index) {
+	WorkerShard& shard = shards_[index & shard_mask_];
 	while (true) {
-		std::unique_lock<std::mutex> latch{mutex_};
-		task_cond_.wait(latch, [this] {
-			return should_finish_ || !job_queue_->empty();
-		});
-		if (job_queue_->empty() && should_finish_)
+		if (_retire_if_surplus(index)) {
+			_notify_if_idle(); // In case this worker ran the last job.
 			return;
-		std::unique_ptr<Job> job = job_queue_->getJob();
-		++working_threads_;
+		}
+
+		Node& home = *nodes_[current_node];
+		ProfiledLock latch{mutex_, _lock_counters(pool_lock_profile_, LockSite::DEQUEUE)};
+		// Finishing a job doesn't take mutex_, so workers check here whether the pool went idle, before parking
+		// or exiting. Every worker passes through here after its job, so the last to finish sees the count at 0.
+		if (!idle_reported_ && !_has_pending_jobs() && _working_threads() == 0) {
+			latch.unlock();
+			_notify_if_idle();
+			continue;
+		}
+		/* Before waiting, run a job kept in a busy worker's LIFO slot or batch, so it doesn't wait for that worker's
+		   job. With jobs queued, still run overdue kept jobs first. */
+		if (!paused_) {
+			if (JobPtr kept = _take_kept(index, _has_pending_jobs())) {
+				started_jobs_.fetch_add(1, std::memory_order_relaxed);
+				shard.running.fetch_add(1, std::memory_order_relaxed);
+				latch.unlock();
+				_run_job(std::move(kept));
+				continue;
+			}
+		}
+		++home.waiting_threads;
+		const auto ready = [this] {
+			return should_finish_ || retiring_threads_ > 0 || (!paused_ && _has_pending_jobs());
+		};
+		if (!ready()) {
+			_trace(TraceEvent::PARK);
+			// While there are spares, wake when their grace period ends, so one retires.
+			if (_surplus_threads())
+				latch.wait_until(home.task_cond, clock::time_point(std::chrono::nanoseconds(spare_until_ns_.load(std::memory_order_relaxed))), ready);
+			else
+				latch.wait(home.task_cond, ready);
+			_trace(TraceEvent::UNPARK);
+		}
+		--home.waiting_threads;
+		if (home.notified_threads > 0)
+			--home.notified_threads;
+		if (!ready())
+			continue; // A spare's grace period ended: back to the top to retire.
+		if (!_has_pending_jobs() && should_finish_)
+			return;
+		if (!should_finish_ && (paused_ || retiring_threads_ > 0))
+			continue; // Back to the top, to retire or wait again.
+		JobPtr job = _take_job(current_node, &shard);
+		shard.running.fetch_add(1, std::memory_order_relaxed);
 		latch.unlock();
+		_run_job(std::move(job));
+	}
+}
 
-		if (job) // Job queue may have been cleared before we got a job.
-			(*job)();
+bool Threadpool::_run_pending_job() {
+	// Lets a worker that is waiting on other jobs run one instead.
+	if (current_pool != this)
+		return false;
+	WorkerShard& shard = shards_[current_worker & shard_mask_];
+	// A job kept in this worker's LIFO slot first: most likely the waiting job added it. Then its batch.
+	JobPtr kept = _take_lifo_slot(shard);
+	if (!kept)
+		kept = _take_batched(shard);
+	if (kept) {
+		started_jobs_.fetch_add(1, std::memory_order_relaxed);
+		shard.running.fetch_add(1, std::memory_order_relaxed);
+		_run_job(std::move(kept));
+		return true;
+	}
+	ProfiledLock latch{mutex_, _lock_counters(pool_lock_profile_, LockSite::DEQUEUE)};
+	if (paused_ || !_has_pending_jobs())
+		return false;
+	JobPtr job = _take_job(current_node);
+	shard.running.fetch_add(1, std::memory_order_relaxed);
+	latch.unlock();
+	_run_job(std::move(job));
+	return true;
+}
 
-		latch.lock();
-		--working_threads_;
-		latch.unlock();
-		finished_all_jobs_cond_.notify_one();
+void Threadpool::_run_job(JobPtr job) {
+	// The caller has taken the job and counted it in its shard.
+	WorkerShard& shard = shards_[current_worker & shard_mask_];
+	do {
+		if (job) { // Job queue may have been cleared before we got a job.
+			// Jobs the pool doesn't own may be gone once run, so keep what's needed afterwards.
+			const clock::time_point enqueued = job->enqueued_;
+			const char* label = job->label_;
+			ExecutorQueue* executor = job->executor_;
+			const double charged = job->charged_;
+			const clock::time_point taken = clock::now();
+			const clock::duration wait = taken - enqueued;
+			// Growth only goes by time spent waiting for a worker, not for an executor's concurrency limit.
+			const clock::duration workerWait = executor ? taken - job->ready_ : wait;
+			_record_queue_wait(workerWait);
+			// A long wait means the pool is falling behind even though nobody is submitting right now.
+			if (workerWait >= std::chrono::nanoseconds(growth_delay_ns_.load(std::memory_order_relaxed)) && _should_extend())
+				_extend();
+			const bool trackLatency = track_latency_.load(std::memory_order_relaxed);
+			const bool recordWorkload = record_workload_.load(std::memory_order_relaxed);
+			const clock::time_point started = trackLatency || recordWorkload ? clock::now() : clock::time_point{};
+			const std::chrono::nanoseconds outer = nested_cpu_time;
+			nested_cpu_time = std::chrono::nanoseconds{0};
+			_trace(TraceEvent::JOB_BEGIN, label);
+			const std::chrono::nanoseconds start = system_info::threadCpuTime();
+			Job* running = job.release();
+			const bool owned = running->owned_;
+			(*running)();
+			if (owned)
+				delete running;
+			const std::chrono::nanoseconds elapsed = system_info::threadCpuTime() - start;
+			_trace(TraceEvent::JOB_END);
+			const std::chrono::nanoseconds cpuTime = elapsed - nested_cpu_time; // Jobs run while this one waited are charged to their own source.
+			nested_cpu_time = outer + elapsed;
+			if (trackLatency || recordWorkload) {
+				const clock::duration runTime = clock::now() - started;
+				LatencyRecorder& recorder = _latency_recorder();
+				if (trackLatency) {
+					recorder.queue_wait.record(wait);
+					recorder.run_time.record(runTime);
+				}
+				if (recordWorkload) {
+					std::lock_guard<std::mutex> lock{recorder.jobs_mutex};
+					recorder.jobs.push_back({ enqueued, wait, runTime, label });
+				}
+			}
+
+			// Only executor jobs take mutex_ here.
+			_finish_job(executor, charged, cpuTime);
+			shard.completed.fetch_add(1, std::memory_order_relaxed);
+			shard.busy_ns.fetch_add(cpuTime.count(), std::memory_order_relaxed);
+		}
+
+		// A job this worker kept in its LIFO slot, or else the next of its batch, runs under the same count, so the pool
+		// can't look idle in between. Overdue jobs other workers kept go before the rest of the batch.
+		job = _take_lifo_slot(shard);
+		if (!job && shard.batched.load(std::memory_order_relaxed) > 0) {
+			job = _take_kept(current_worker + 1, true);
+			if (!job)
+				job = _take_batched(shard);
+		}
+		if (job)
+			started_jobs_.fetch_add(1, std::memory_order_relaxed);
+	} while (job);
+	// A worker helping a TaskGroup is still counted for its own job, so the pool can only go idle once the worker
+	// is back in _run_thread, which reports it.
+	shard.running.fetch_sub(1, std::memory_order_release);
+}
+
+Threadpool::Executor::Executor(Threadpool& pool, std::shared_ptr<ExecutorQueue> queue)
+	: pool_(&pool), queue_(std::move(queue))
+{}
+
+Threadpool::Executor::Executor(Executor&& other) noexcept
+	: pool_(other.pool_), queue_(std::move(other.queue_))
+{}
+
+Threadpool::Executor& Threadpool::Executor::operator=(Executor&& other) noexcept {
+	if (this != &other) {
+		if (queue_)
+			pool_->_release_executor(*queue_);
+		pool_ = other.pool_;
+		queue_ = std::move(other.queue_);
+	}
+	return *this;
+}
+
+Threadpool::Executor::~Executor() {
+	if (queue_)
+		pool_->_release_executor(*queue_);
+}
+
+void Threadpool::Executor::setWeight(unsigned int weight) {
+	ProfiledLock lock{pool_->mutex_, pool_->_lock_counters(pool_->pool_lock_profile_, LockSite::OTHER)};
+	queue_->weight = std::max(weight, 1u);
+}
+
+Threadpool::Executor::Stats Threadpool::Executor::stats() const {
+	ProfiledLock lock{pool_->mutex_, pool_->_lock_counters(pool_->pool_lock_profile_, LockSite::OTHER)};
+	return { queue_->queue.size(), static_cast<std::size_t>(queue_->running), queue_->completed, queue_->cpu_time };
+}
+
+std::size_t Threadpool::Executor::numPendingJobs() const {
+	return queue_->queue.size();
+}
+
+std::size_t Threadpool::Executor::numRunningJobs() const {
+	ProfiledLock lock{pool_->mutex_, pool_->_lock_counters(pool_->pool_lock_profile_, LockSite::OTHER)};
+	return static_cast<std::size_t>(queue_->running);
+}
+
+struct Threadpool::TaskGroup::State {
+	std::atomic<std::size_t> pending{0};
+	std::mutex mutex;
+	std::condition_variable done_cond;
+	std::vector<std::exception_ptr> errors; // Guarded by mutex.
+};
+
+Threadpool::TaskGroup::Errors::Errors(std::vector<std::exception_ptr> exceptions)
+	: std::runtime_error("Threadpool task group jobs failed"), exceptions(std::move(exceptions))
+{}
+
+Threadpool::TaskGroup::TaskGroup(Threadpool& pool)
+	: pool_(&pool), state_(std::make_shared<State>())
+{}
+
+Threadpool::TaskGroup::~TaskGroup() {
+	_wait_until(nullptr);
+}
+
+void Threadpool::TaskGroup::wait() {
+	_wait_until(nullptr);
+	std::vector<std::exception_ptr> errors;
+	{
+		std::lock_guard<std::mutex> lock{state_->mutex};
+		errors.swap(state_->errors);
+	}
+	if (!errors.empty())
+		throw Errors(std::move(errors));
+}
+
+bool Threadpool::TaskGroup::wait_for(clock::duration timeout) {
+	const clock::time_point deadline = clock::now() + timeout;
+	if (!_wait_until(&deadline))
+		return false;
+	wait();
+	return true;
+}
+
+std::size_t Threadpool::TaskGroup::numPendingJobs() const {
+	return state_->pending;
+}
+
+void Threadpool::TaskGroup::_finish(State& state, std::exception_ptr error) {
+	if (error) {
+		std::lock_guard<std::mutex> lock{state.mutex};
+		state.errors.push_back(std::move(error));
+	}
+	// Only the last job takes the lock, so waiters can't miss the wakeup between checking the count and waiting.
+	if (--state.pending == 0) {
+		std::lock_guard<std::mutex> lock{state.mutex};
+		state.done_cond.notify_all();
+	}
+}
+
+void Threadpool::TaskGroup::_run(JobPtr job) {
+	++state_->pending;
+	pool_->_add(std::move(job), CURRENT_NODE);
+}
+
+bool Threadpool::TaskGroup::_wait_until(const clock::time_point* deadline) {
+	// No deadline -> wait indefinitely.
+	while (state_->pending > 0) {
+		if (deadline && clock::now() >= *deadline)
+			return false;
+		if (pool_->_run_pending_job())
+			continue;
+
+		// Nothing to help with: the group's jobs are running elsewhere, or held back by pause or an executor's limit.
+		BlockingScope scope(*pool_);
+		std::unique_lock<std::mutex> lock{state_->mutex};
+		const auto finished = [this] { return state_->pending == 0; };
+		if (!deadline)
+			state_->done_cond.wait(lock, finished);
+		else if (!state_->done_cond.wait_until(lock, *deadline, finished))
+			return false;
 	}
+	return true;
 }
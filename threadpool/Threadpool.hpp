@@ -1,24 +1,101 @@
 #pragma once
 
+#include "LockProfile.hpp"
+#include "TraceBuffer.hpp"
+#include "WorkloadTrace.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 
 class Threadpool {
 public:
 	using thread_num = int_fast16_t;
+	using clock = std::chrono::steady_clock;
+
+	// Size from the CPUs available to this process (hardware, affinity mask and cgroup quota).
+	static constexpr thread_num AUTO_THREADS = -1;
 
-	static constexpr thread_num DEFAULT_INITIAL_THREADS = 8;
-	static constexpr thread_num DEFAULT_MAX_THREADS = 0;
+	static constexpr thread_num DEFAULT_INITIAL_THREADS = AUTO_THREADS;
+	static constexpr thread_num DEFAULT_MAX_THREADS = AUTO_THREADS;
 	static constexpr thread_num DEFAULT_POOL_EXTEND_INCR = 4;
+	static constexpr std::chrono::microseconds DEFAULT_GROWTH_DELAY{1000};
+	static constexpr thread_num DEFAULT_MAX_COMPENSATING_THREADS = 64;
+	static constexpr std::chrono::milliseconds DEFAULT_SPARE_WORKER_GRACE{100};
+	static constexpr std::size_t DEFAULT_TRACE_EVENTS = 1 << 16;
+	// Alignment that keeps data written by different threads off each other's cache lines.
+	static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+	// How worker threads are pinned to CPUs. Topology is read from /sys/devices/system/cpu; only applied on Linux.
+	enum class Affinity {
+		NONE,           // Let the OS schedule workers on any CPU.
+		COMPACT,        // Pack workers onto neighbouring CPUs: hyperthreads of a core, then cores of a package.
+		SCATTER,        // Spread workers across packages and cores before sharing any core.
+		EXPLICIT,       // Use ThreadOptions::cpus in order. The pool's constructor throws std::invalid_argument if it's empty.
+		PHYSICAL_CORES, // One worker per physical core, leaving hyperthread siblings unused.
+		NUMA_NODES,     // Spread workers evenly over NUMA nodes, free to run on any CPU of their node. Each node gets
+		                // its own job queue; workers only take jobs from other nodes once their own queue is empty.
+	};
+
+	// Linux scheduling policy for worker threads.
+	enum class Scheduling {
+		DEFAULT, // Inherit the creating thread's policy.
+		BATCH,   // SCHED_BATCH: CPU-bound, throughput over latency.
+		IDLE,    // SCHED_IDLE: only run when nothing else wants the CPU.
+		FIFO,    // SCHED_FIFO at fifoPriority. Needs CAP_SYS_NICE, otherwise the default policy is kept.
+	};
+
+	enum class ShutdownMode {
+		DRAIN,          // Run every queued job.
+		FINISH_RUNNING, // Cancel queued jobs, and wait for running ones to finish.
+		DISCARD,        // Cancel queued jobs, and return without waiting for running ones.
+	};
+
+	// The order queued jobs are started in.
+	enum class DispatchOrder {
+		FIFO,      // Oldest first: no job waits behind ones added after it.
+		LIFO,      // Newest first, so the jobs a job adds run while the data it left them is still in cache.
+		           // Under load, old jobs can wait for a long time.
+		LIFO_SLOT, // As FIFO, except that while no worker is idle, the last job a worker adds runs next on it.
+	};
+
+	// The error futures of cancelled jobs hold: jobs cleared, discarded by shutdown, or added after it.
+	struct JobCancelled : public std::runtime_error {
+		JobCancelled() : std::runtime_error("Threadpool job was cancelled") {}
+	};
+
+	struct ThreadOptions {
+		Affinity affinity = Affinity::NONE;
+		std::vector<unsigned int> cpus; // CPUs for Affinity::EXPLICIT. Workers wrap around if there are more of them.
+
+		std::size_t stackSize = 0;  // Bytes, rounded up to the platform minimum. 0 -> platform default.
+		std::string namePrefix;     // Workers are named <namePrefix><index>, in 15 characters on Linux. Empty -> unnamed.
+		int nice = 0;               // Nice value for each worker. Negative values need privileges and are otherwise skipped.
+		Scheduling scheduling = Scheduling::DEFAULT;
+		int fifoPriority = 1;
+	};
 public:
 	/* Create a new thread pool.
-	   initThreads  The initial number of threads to be created.
-	   maxThreads   Max number of threads that can be created (0 -> initThreads).
+	   initThreads  The initial number of threads to be created (AUTO_THREADS -> one per available CPU).
+	   maxThreads   Max number of threads that can be created (0 -> no limit, AUTO_THREADS -> max of initThreads and available CPUs).
 	   extendIncr   How many threads to extend the thread pool by when full, up to max threads.*/
 	Threadpool(thread_num initThreads = DEFAULT_INITIAL_THREADS, thread_num maxThreads = DEFAULT_MAX_THREADS, thread_num extendIncr = DEFAULT_POOL_EXTEND_INCR);
-	// Finishes all jobs first.
+	/* As above, with options applied to every worker thread. With Affinity::PHYSICAL_CORES,
+	   AUTO_THREADS sizes use the number of physical cores instead of available CPUs. */
+	Threadpool(thread_num initThreads, thread_num maxThreads, thread_num extendIncr, const ThreadOptions& options);
+	// Finishes all jobs first, unless shut down already.
 	~Threadpool();
 
 	Threadpool(const Threadpool&) = delete;
@@ -26,64 +103,550 @@ public:
 	Threadpool& operator=(const Threadpool&) = delete;
 	Threadpool& operator=(Threadpool&&) = delete;
 
+	// With Affinity::NUMA_NODES, the job is queued on the submitting thread's node.
 	template<typename FuncType, typename... Args>
 	auto add(FuncType&& func, Args&&... args) {
-		using PackageType = std::packaged_task<std::invoke_result_t<FuncType&&, Args&&...>()>;
+		return _submit(CURRENT_NODE, std::forward<FuncType>(func), std::forward<Args>(args)...);
+	}
+
+	// As add, with a label for the job in traces. The label must outlive the pool, e.g. a string literal.
+	template<typename FuncType, typename... Args>
+	auto addLabeled(const char* label, FuncType&& func, Args&&... args) {
+		auto [job, future] = _make_job(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		job->label_ = label;
+		_add(std::move(job), CURRENT_NODE);
+		return std::move(future);
+	}
+
+	// As add, queued in the given order instead of the pool's.
+	template<typename FuncType, typename... Args>
+	auto addWithOrder(DispatchOrder order, FuncType&& func, Args&&... args) {
+		auto [job, future] = _make_job(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		_add(std::move(job), CURRENT_NODE, order);
+		return std::move(future);
+	}
+
+	/* As add, except that the job runs right away on the calling thread if it would likely wait in the queue for
+	   longer than maxWait: the pool is paused, or its idle workers can't take every queued job and those ahead of
+	   it, at their average CPU time, would keep the workers busy for longer than that. Either way, the result is
+	   in the returned future.
+	   Jobs run inline aren't counted as submitted, only in Stats::inlineJobs. */
+	template<typename FuncType, typename... Args>
+	auto addOrRun(clock::duration maxWait, FuncType&& func, Args&&... args) {
+		auto [job, future] = _make_job(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		if (JobPtr late = _add(std::move(job), CURRENT_NODE, dispatch_order_.load(std::memory_order_relaxed), maxWait))
+			(*late)();
+		return std::move(future);
+	}
+
+	/* Run func and return its result (or throw its exception). On this pool's workers it runs inline, so a job can
+	   call code that uses the pool without a queue round trip, or waiting on itself; other threads add it as a job
+	   and wait for it. Either way func is invoked with the arguments as passed, without copying them. */
+	template<typename FuncType, typename... Args>
+	decltype(auto) runSync(FuncType&& func, Args&&... args) {
+		auto call = [&func, &args...]() -> decltype(auto) {
+			return std::invoke(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		};
+		if (currentWorkerIndex() >= 0)
+			return call();
+		return add(call).get();
+	}
 
-		auto task = PackageType(std::bind(std::forward<FuncType>(func), std::forward<Args>(args)...));
-		auto future = task.get_future();
+	/* Queue a job on the given NUMA node (its id under /sys/devices/system/node).
+	   Jobs for nodes without workers are queued on the submitting thread's node. */
+	template<typename FuncType, typename... Args>
+	auto addOnNode(unsigned int node, FuncType&& func, Args&&... args) {
+		return _submit(_node_index(node), std::forward<FuncType>(func), std::forward<Args>(args)...);
+	}
+
+	/* Marks the job running on the calling thread as blocked (on I/O, a lock, ...) while in scope.
+	   The pool starts a compensating worker in its place, up to a limit, so CPU-bound jobs keep every core
+	   busy. Once blocked regions end, surplus workers are kept as spares for a grace period, for the next blocked
+	   regions to use instead of starting threads, and then retire. Has no effect on threads other than this
+	   pool's workers, and nested scopes on one thread count once. */
+	class BlockingScope {
+	public:
+		explicit BlockingScope(Threadpool& pool);
+		~BlockingScope();
+		BlockingScope(const BlockingScope&) = delete;
+		BlockingScope& operator=(const BlockingScope&) = delete;
+	private:
+		Threadpool* pool_ = nullptr; // Set if this scope counts as blocking.
+	};
+
+	/* A handle for submitting jobs to this pool's workers through a queue of their own, e.g. one per subsystem or tenant.
+	   At most maxConcurrency (0 -> no limit) of its jobs run at once. Workers pick between executors with pending
+	   jobs, and jobs added to the pool directly, so that each gets CPU time in proportion to its weight (stride
+	   scheduling on measured thread CPU time), and no executor can starve the others however many jobs it queues.
+	   Must not outlive the pool; its queued jobs still run after it's destroyed. */
+	class Executor;
+	Executor makeExecutor(thread_num maxConcurrency = 0, unsigned int weight = 1);
+
+	/* A set of jobs that can be waited on without waiting on the rest of the pool. A worker waiting on a group
+	   runs the pool's pending jobs meanwhile, and only blocks (as in a BlockingScope) once there are none. */
+	class TaskGroup;
 
-		_add(std::make_unique<PackagedJob<PackageType>>(std::move(task)));
+	/* A std::execution (P2300) scheduler that runs work on this pool's workers, for sender/receiver code.
+	   Defined in Scheduler.hpp, which must be included to use it. */
+	class Scheduler;
+	Scheduler get_scheduler() noexcept;
 
-		return future;
+	// Run func on the calling thread inside a BlockingScope, returning its result.
+	template<typename FuncType>
+	decltype(auto) blocking(FuncType&& func) {
+		BlockingScope scope(*this);
+		return std::forward<FuncType>(func)();
 	}
 
+	// Order for jobs added from now on (FIFO by default). Executors' queues stay FIFO.
+	void setDispatchOrder(DispatchOrder order);
+
+	/* Stop starting jobs: queued jobs stay queued and running jobs finish. New jobs can still be added.
+	   Waiting on all jobs while paused blocks until resumed; destroying a paused pool still runs its jobs. */
+	void pause();
+	void resume();
+	bool isPaused() const;
+
+	/* Set the number of threads, not counting those compensating for BlockingScopes. Extra threads retire
+	   as soon as they finish their current job. Raises the max threads if needed. */
+	void resize(thread_num numThreads);
+	// 0 -> no limit. Retires threads above the new limit.
+	void setMaxThreads(thread_num maxThreads);
+	void setExtendIncrement(thread_num extendIncr);
+
+	/* Stop accepting jobs, deal with queued jobs according to mode, and stop the threads. Jobs still queued
+	   at the deadline are cancelled. Running jobs can't be interrupted: if any are still running when this
+	   returns, their threads are joined by the destructor. Returns the number of jobs cancelled. */
+	std::size_t shutdown(ShutdownMode mode, clock::time_point deadline = clock::time_point::max());
+
 	// Wait for all current jobs to finish.
 	void waitOnAllJobs();
+	// As above, giving up after the timeout or at the deadline. Return whether the pool became idle.
+	bool waitOnAllJobs_for(clock::duration timeout);
+	bool waitOnAllJobs_until(clock::time_point deadline);
+	/* Called each time the pool becomes idle, on a worker that finished one of the last jobs (or the thread that
+	   cleared the last queued ones), outside of any lock. Waiting on all jobs also waits for it to return.
+	   Must not block. Empty -> none. */
+	void setIdleCallback(std::function<void()> callback);
 	// Check if all jobs are completed.
 	bool isIdle() const;
 
+	// Cancels every queued job.
 	void clearPendingJobs();
 
+	/* How long jobs must wait in the queue, with every thread busy, before the pool is extended.
+	   Also the minimum time between two extensions, so short bursts don't spawn threads. */
+	void setGrowthDelay(std::chrono::microseconds delay);
+	// Most compensating workers BlockingScopes may add at once.
+	void setMaxCompensatingThreads(thread_num maxThreads);
+	// How long surplus compensating workers are kept after the last blocked region ends, before they retire.
+	void setSpareWorkerGrace(std::chrono::microseconds grace);
+
+	/* Re-read the CPUs available to this process and apply them to any AUTO_THREADS sizes, as the constructor
+	   does, resizing the pool to its automatic initial size if it has one. Returns the CPUs sized by (physical
+	   cores with Affinity::PHYSICAL_CORES). */
+	thread_num refreshSizing();
+
+	/* A snapshot of the pool's counters, read without locks so it can be polled often. Each value is read on its
+	   own, so while jobs are moving they may be a few jobs apart from each other. */
+	struct Stats {
+		std::size_t threads;
+		std::size_t busyThreads;   // Running a job.
+		std::size_t idleThreads;
+		std::size_t pendingJobs;   // Queued, in the pool or its executors.
+		std::uint64_t submittedJobs;
+		std::uint64_t completedJobs; // Run, whether they returned or threw.
+		std::uint64_t cancelledJobs; // Cleared, or discarded by shutdown.
+		std::uint64_t rejectedJobs;  // Added after shutdown, and cancelled.
+		std::uint64_t inlineJobs;    // Run on the calling thread by addOrRun instead of being queued.
+		std::chrono::nanoseconds busyTime; // Thread CPU time spent in jobs.
+	};
+	Stats stats() const;
+
 	std::size_t numPendingJobs() const;
 	std::size_t numIdleThreads() const;
 	std::size_t numThreads() const;
+	// Threads currently inside a BlockingScope.
+	std::size_t numBlockedThreads() const;
+	// Number of job queues: one per NUMA node with Affinity::NUMA_NODES, otherwise 1.
+	std::size_t numNodes() const;
+	/* Index of the calling worker, or -1 on threads that aren't this pool's workers. Indices are below the most
+	   threads the pool has had at once; a retired worker's index is reused by the next worker added.
+	   See WorkerLocal.hpp for per-worker data. */
+	int currentWorkerIndex() const;
+
+	/* Record how long each job waits to be picked up, and how long it runs for (wall time), in per-worker
+	   histograms. Off by default; costs two clock reads per job when on, and an atomic load when off. */
+	void setLatencyTracking(bool enabled);
+
+	struct LatencySummary {
+		std::uint64_t count;
+		std::chrono::nanoseconds p50, p90, p99, p999, max;
+	};
+	struct LatencyStats {
+		LatencySummary queueWait;
+		LatencySummary runTime;
+	};
+	// Merges every worker's histograms. Values are within 1/16 of the true latencies.
+	LatencyStats latencyStats() const;
+
+	/* Record each job's submit time, label, queue wait and run time, to replay the workload against other pool
+	   configurations (see bench/replay_bench.cpp). Off by default. Records are kept until taken. */
+	void setWorkloadRecording(bool enabled);
+	// Takes the jobs recorded so far, in submit order.
+	WorkloadTrace takeWorkloadTrace();
+
+	/* Count acquisitions and contention of the pool's lock and its job queues' locks, and time spent waiting for
+	   and holding them, at each site they're taken at. Off by default; costs an atomic load per lock when off. */
+	void setLockProfiling(bool enabled);
+	struct LockProfileStats {
+		std::array<LockStats, LOCK_SITES> pool;   // The pool-wide lock, indexed by LockSite.
+		std::array<LockStats, LOCK_SITES> queues; // Every job queue's lock, combined.
+	};
+	LockProfileStats lockStats() const;
+
+	/* Record jobs starting and ending, workers parking and unparking, jobs stolen from other NUMA nodes, and pool
+	   growth, into a ring of eventsPerThread events for each thread (applied to threads that haven't traced yet).
+	   Off by default; costs an atomic load per event when off, and a clock read and a few stores when on. */
+	void setTracing(bool enabled, std::size_t eventsPerThread = DEFAULT_TRACE_EVENTS);
+	/* Write the recorded events as Chrome Trace Event JSON, to load in Perfetto or chrome://tracing.
+	   Can be called while tracing. Returns whether the file was written. */
+	bool dumpTrace(const std::string& path) const;
 
 private:
+	struct ExecutorQueue;
+
 	struct Job {
 		virtual ~Job() = default;
 		virtual void operator()() = 0;
+		// Complete the job's future with JobCancelled instead of running it.
+		virtual void cancel() = 0;
 		Job() = default;
 		Job(const Job&) = delete;
 		Job& operator=(const Job&) = delete;
+
+		clock::time_point enqueued_;
+		clock::time_point ready_;           // For executor jobs, set when taken: since when it only waited on workers.
+		ExecutorQueue* executor_ = nullptr; // Set for jobs added through an Executor.
+		double charged_ = 0;                // Scheduling cost charged up front, corrected once the job has run.
+		const char* label_ = nullptr;       // Name in traces.
+		// False for jobs embedded in their submitter's storage (see Scheduler.hpp), which may be gone as soon as
+		// they have been run or cancelled: the pool neither deletes them nor touches them afterwards.
+		bool owned_ = true;
 	};
 
-	template <typename PackageType>
+	// Deletes the jobs the pool owns. Converts from std::default_delete, so std::make_unique jobs can be queued.
+	struct JobDeleter {
+		JobDeleter() = default;
+		template<typename T>
+		JobDeleter(std::default_delete<T>) noexcept {}
+		void operator()(Job* job) const {
+			if (job->owned_)
+				delete job;
+		}
+	};
+	using JobPtr = std::unique_ptr<Job, JobDeleter>;
+
+	template <typename FuncType, typename ResultType>
 	struct PackagedJob : public Job {
-		explicit constexpr PackagedJob(PackageType&& task) noexcept : task_{std::move(task)} {}
-		constexpr void operator()() override { task_(); }
+		explicit PackagedJob(FuncType&& func) : func_{std::move(func)} {}
+		void operator()() override {
+			try {
+				if constexpr (std::is_void_v<ResultType>) {
+					func_();
+					promise_.set_value();
+				} else {
+					promise_.set_value(func_());
+				}
+			} catch (...) {
+				promise_.set_exception(std::current_exception());
+			}
+		}
+		void cancel() override { promise_.set_exception(std::make_exception_ptr(JobCancelled())); }
+		std::future<ResultType> get_future() { return promise_.get_future(); }
 	private:
-		PackageType task_;
+		FuncType func_;
+		std::promise<ResultType> promise_;
 	};
 
 private:
-	void _add(std::unique_ptr<Job> job);
+	static constexpr std::size_t CURRENT_NODE = static_cast<std::size_t>(-1);
+
+	template<typename FuncType, typename... Args>
+	static auto _make_job(FuncType&& func, Args&&... args) {
+		using ResultType = std::invoke_result_t<FuncType&&, Args&&...>;
+
+		auto bound = std::bind(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		auto job = std::make_unique<PackagedJob<decltype(bound), ResultType>>(std::move(bound));
+		auto future = job->get_future();
+
+		return std::make_pair(JobPtr(std::move(job)), std::move(future));
+	}
+
+	template<typename FuncType, typename... Args>
+	auto _submit(std::size_t node, FuncType&& func, Args&&... args) {
+		auto [job, future] = _make_job(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		_add(std::move(job), node);
+		return std::move(future);
+	}
+
+	void _add(JobPtr job, std::size_t node);
+	void _add(JobPtr job, std::size_t node, DispatchOrder order);
+	// As above; given maxWait, returns the job instead if it should run inline (see addOrRun), or null once queued.
+	JobPtr _add(JobPtr job, std::size_t node, DispatchOrder order, std::optional<clock::duration> maxWait);
+	void _add_to_executor(JobPtr job, ExecutorQueue& executor);
+	void _release_executor(ExecutorQueue& executor);
+	bool _wake_worker(std::size_t node);
+	bool _has_idle_worker() const;
+	bool _should_run_inline(clock::duration maxWait) const;
+	std::size_t _node_index(unsigned int node) const;
+	std::size_t _current_node() const;
+	bool _has_pending_jobs() const;
+	thread_num _working_threads() const;
+	std::size_t _pending_jobs() const;
+	struct WorkerShard;
+	JobPtr _take_job(std::size_t node, WorkerShard* batch = nullptr);
+	void _finish_job(ExecutorQueue* executor, double charged, std::chrono::nanoseconds cpuTime);
+	bool _finished_all_jobs() const;
+	void _notify_if_idle();
+	std::size_t _cancel_pending_jobs();
+	static void _cancel(JobPtr job);
+	JobPtr _take_lifo_slot(WorkerShard& shard);
+	JobPtr _take_batched(WorkerShard& shard, bool newest = false);
+	JobPtr _take_kept(std::size_t first, bool overdueOnly);
+	std::size_t _requeue_batch(WorkerShard& shard, std::size_t node);
+	void _join_workers();
+	void _record_queue_wait(clock::duration wait);
+	struct LatencyRecorder;
+	LatencyRecorder& _latency_recorder();
+	void _trace(TraceEvent type, const char* label = nullptr, std::uint32_t arg = 0) {
+		if (tracing_.load(std::memory_order_relaxed))
+			_record_trace(type, label, arg);
+	}
+	void _record_trace(TraceEvent type, const char* label, std::uint32_t arg);
+	static std::uint64_t _next_id();
+	LockProfile::Counters* _lock_counters(LockProfile& profile, LockSite site) const {
+		return profile_locks_.load(std::memory_order_relaxed) ? &profile.at(site) : nullptr;
+	}
+	bool _has_live_worker() const;
+	bool _should_extend();
 	thread_num _extend();
-	void _run_thread();
+	thread_num _sizing_cpus() const;
+	thread_num _apply_sizing();
+	void _grow_or_recheck();
+	void _schedule_growth_check();
+	void _run_growth_checks();
+	void _stop_growth_checks();
+	void _add_threads(thread_num count);
+	void _resize(thread_num numThreads);
+	void _reap_retired();
+	void _init_thread(std::size_t index);
+	bool _surplus_threads() const;
+	bool _spare_expired() const;
+	bool _retire_if_surplus(std::size_t index);
+	bool _run_pending_job();
+	void _run_job(JobPtr job);
+	void _run_thread(std::size_t index);
 
 private:
 	class JobQueue;
-	std::unique_ptr<JobQueue> job_queue_;
+	struct Node;
+	std::vector<std::unique_ptr<Node>> nodes_;
+	std::vector<std::size_t> cpu_nodes_; // Node index of each CPU, if there are several nodes.
+
+	// Executors and the stride scheduler's virtual time; the pool's own queues act as one more source of weight 1.
+	std::vector<std::shared_ptr<ExecutorQueue>> executors_; // Guarded by mutex_.
+	std::atomic<std::size_t> executor_jobs_{0};             // Jobs queued in all executors.
+	double pool_pass_ = 0;                                  // Guarded by mutex_.
+	double virtual_time_ = 0;                               // Guarded by mutex_.
+	// Written by every worker after each pool job, so kept off the lines of state that is mostly read.
+	alignas(CACHE_LINE_SIZE) std::atomic<double> pool_avg_cost_{0};
+	std::atomic<std::int64_t> pool_pass_correction_{0};     // Settled pool job costs not yet applied to pool_pass_.
+
+	/* Worker registry, indexed by worker. Retired workers leave an empty slot for the next new worker and wait in
+	   retired_ to be joined. Only modified with workers_mutex_ held; num_threads_ counts live workers for lock-free reads. */
+	struct Worker;
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::vector<std::unique_ptr<Worker>> retired_;
+	std::atomic<thread_num> num_threads_{0};
+	std::mutex workers_mutex_;
+
+	std::atomic<thread_num> num_extend_{DEFAULT_POOL_EXTEND_INCR};
+	/* Guarded by workers_mutex_. The sizes asked for, by the constructor or since (AUTO_THREADS, or an explicit
+	   size), and the CPUs they were last applied to; max_threads_ follows from them. */
+	thread_num requested_threads_ = AUTO_THREADS;
+	thread_num requested_max_threads_ = AUTO_THREADS;
+	thread_num sized_cpus_ = 0;
+	thread_num max_threads_ = 0;
+	std::atomic<thread_num> retiring_threads_{0}; // Workers asked to retire by resizing, only decreased with workers_mutex_ held.
+
+	ThreadOptions thread_options_;
+	std::vector<unsigned int> cpu_order_; // CPU for each worker index, if pinned.
 
-	std::vector<std::thread> threads_;
+	// Growth controller state, in steady_clock nanoseconds. The delay is read for every job, the rest written.
+	std::atomic<std::int64_t> growth_delay_ns_;
+	alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t> avg_queue_wait_ns_{0};
+	std::atomic<std::int64_t> last_extend_ns_{0};
+	std::atomic<std::size_t> last_backlog_{0};
+	/* Re-checks growth on a thread of its own when it was too soon to tell on submit, in case nothing else does.
+	   Started on first use, stopped on shutdown. */
+	std::atomic<std::int64_t> growth_check_ns_{0}; // When the next check is due; 0 -> none pending.
+	std::thread growth_thread_;                    // Guarded by growth_mutex_.
+	bool growth_stop_ = false;                     // Guarded by growth_mutex_.
+	std::mutex growth_mutex_;
+	std::condition_variable growth_cond_;
 
-	thread_num num_extend_ = DEFAULT_POOL_EXTEND_INCR;
-	thread_num max_threads_ = DEFAULT_MAX_THREADS;
+	/* Workers inside a BlockingScope, and workers added to make up for them. Blocked workers change blocked_threads_
+	   themselves, without a lock: on entering a scope before they check for compensation under workers_mutex_,
+	   so every check sees them. compensating_threads_ only changes with workers_mutex_ held. */
+	std::atomic<thread_num> blocked_threads_{0};
+	std::atomic<thread_num> compensating_threads_{0};
+	std::atomic<thread_num> max_compensating_threads_{DEFAULT_MAX_COMPENSATING_THREADS};
+	// Surplus compensating workers are spares until then (steady_clock nanoseconds).
+	std::atomic<std::int64_t> spare_grace_ns_;
+	std::atomic<std::int64_t> spare_until_ns_{0};
 
-	mutable std::mutex mutex_;
+	/* Jobs being run, jobs completed and their CPU time, counted by the worker running them in its shard (worker
+	   index modulo the shard count), so workers don't all write one counter. Sum with _working_threads() or stats();
+	   running counts are only added to under mutex_, or by a worker already counted. Each shard also holds the LIFO
+	   slot and the batch of jobs its workers took from the queue at once, shared once workers outnumber shards. */
+	std::unique_ptr<WorkerShard[]> shards_;
+	std::size_t shard_mask_ = 0;
+
+	alignas(CACHE_LINE_SIZE) mutable std::mutex mutex_;
+	// Only written with mutex_ held, so they share its line; atomic for stats().
+	std::atomic<std::uint64_t> submitted_jobs_{0};
+	std::atomic<std::uint64_t> started_jobs_{0};
+	std::atomic<std::uint64_t> rejected_jobs_{0};
+	std::atomic<std::uint64_t> inline_jobs_{0};
 	std::condition_variable finished_all_jobs_cond_;
-	std::condition_variable task_cond_;
+	std::atomic<std::uint64_t> cancelled_jobs_{0};
+
+	bool should_finish_ = false; // Written with both mutex_ and workers_mutex_ held; read under either.
+	bool paused_ = false;        // Guarded by mutex_.
+	bool accepting_ = true;      // False once shut down. Guarded by mutex_.
+	alignas(CACHE_LINE_SIZE) std::atomic<DispatchOrder> dispatch_order_{DispatchOrder::FIFO};
+	std::atomic<bool> lifo_slots_used_{false}; // Set once a job was kept in a LIFO slot, so workers check the slots.
+	std::atomic<bool> batches_used_{false};    // Set once a worker took a batch of jobs, so workers check the batches.
+	// Latency histograms and recorded jobs for each worker slot, kept for whichever worker takes the slot next.
+	std::atomic<bool> track_latency_{false};
+	std::atomic<bool> record_workload_{false};
+	std::vector<std::unique_ptr<LatencyRecorder>> latency_recorders_; // Guarded by latency_mutex_.
+	mutable std::mutex latency_mutex_;
+	static thread_local LatencyRecorder* current_recorder_;
+
+	std::atomic<bool> profile_locks_{false};
+	mutable LockProfile pool_lock_profile_;
+	mutable LockProfile queue_lock_profile_;
+
+	// Trace buffers for each thread that has recorded events in this pool.
+	std::atomic<bool> tracing_{false};
+	std::atomic<std::size_t> trace_events_{DEFAULT_TRACE_EVENTS};
+	std::vector<std::pair<std::thread::id, std::unique_ptr<TraceBuffer>>> trace_buffers_; // Guarded by trace_mutex_.
+	mutable std::mutex trace_mutex_;
+	const std::uint64_t id_ = _next_id(); // Unique to this pool, unlike its address.
+
+	bool idle_reported_ = true;  // Whether the idle callback has run since a job was last taken. Guarded by mutex_.
+	thread_num idle_callbacks_running_ = 0; // Guarded by mutex_.
+	std::function<void()> idle_callback_; // Guarded by mutex_.
+};
+
+class Threadpool::Executor {
+public:
+	Executor(Executor&& other) noexcept;
+	Executor& operator=(Executor&& other) noexcept;
+	~Executor();
+
+	Executor(const Executor&) = delete;
+	Executor& operator=(const Executor&) = delete;
+
+	template<typename FuncType, typename... Args>
+	auto add(FuncType&& func, Args&&... args) {
+		auto [job, future] = _make_job(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		pool_->_add_to_executor(std::move(job), *queue_);
+		return std::move(future);
+	}
+
+	// Changes the executor's share of CPU time from now on.
+	void setWeight(unsigned int weight);
+
+	struct Stats {
+		std::size_t pendingJobs;
+		std::size_t runningJobs;
+		std::uint64_t completedJobs;
+		std::chrono::nanoseconds cpuTime; // Thread CPU time spent in completed jobs.
+	};
+	Stats stats() const;
+
+	std::size_t numPendingJobs() const;
+	std::size_t numRunningJobs() const;
+
+private:
+	friend class Threadpool;
+	Executor(Threadpool& pool, std::shared_ptr<ExecutorQueue> queue);
+
+	Threadpool* pool_;
+	std::shared_ptr<ExecutorQueue> queue_;
+};
+
+class Threadpool::TaskGroup {
+public:
+	explicit TaskGroup(Threadpool& pool);
+	// Waits for the group's jobs, discarding their exceptions.
+	~TaskGroup();
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	// Thrown by wait with every exception the group's jobs threw (including JobCancelled) since the last wait.
+	struct Errors : public std::runtime_error {
+		explicit Errors(std::vector<std::exception_ptr> exceptions);
+		std::vector<std::exception_ptr> exceptions;
+	};
+
+	template<typename FuncType, typename... Args>
+	void run(FuncType&& func, Args&&... args) {
+		auto bound = std::bind(std::forward<FuncType>(func), std::forward<Args>(args)...);
+		_run(std::make_unique<GroupJob<decltype(bound)>>(state_, std::move(bound)));
+	}
+
+	// Wait for every job run so far, then throw Errors if any of them failed.
+	void wait();
+	// As wait, but give up after timeout. Returns whether every job finished.
+	bool wait_for(clock::duration timeout);
+
+	std::size_t numPendingJobs() const;
+
+private:
+	struct State;
+
+	struct GroupJobBase : public Job {
+		explicit GroupJobBase(std::shared_ptr<State> state) : state_{std::move(state)} {}
+		void cancel() override { _finish(*state_, std::make_exception_ptr(JobCancelled())); }
+	protected:
+		std::shared_ptr<State> state_; // Shared so the group can go once the count drops, while this job is still finishing.
+	};
+
+	template<typename FuncType>
+	struct GroupJob : public GroupJobBase {
+		GroupJob(std::shared_ptr<State> state, FuncType&& func) : GroupJobBase{std::move(state)}, func_{std::move(func)} {}
+		void operator()() override {
+			std::exception_ptr error;
+			try {
+				func_();
+			} catch (...) {
+				error = std::current_exception();
+			}
+			_finish(*this->state_, std::move(error));
+		}
+	private:
+		FuncType func_;
+	};
+
+	static void _finish(State& state, std::exception_ptr error);
+	void _run(JobPtr job);
+	bool _wait_until(const clock::time_point* deadline);
 
-	std::atomic<thread_num> working_threads_;
-	bool should_finish_ = false;
+	Threadpool* pool_;
+	std::shared_ptr<State> state_;
 };
@@ -0,0 +1,95 @@
+#include "TraceBuffer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+	void writeJsonString(std::ostream& out, const char* str) {
+		out << '"';
+		for (; *str; ++str) {
+			const unsigned char c = static_cast<unsigned char>(*str);
+			if (c == '"' || c == '\\') {
+				out << '\\' << *str;
+			} else if (c < 0x20) {
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				out << escaped;
+			} else {
+				out << *str;
+			}
+		}
+		out << '"';
+	}
+
+	// Trace Event timestamps are microseconds.
+	void writeTimestamp(std::ostream& out, std::int64_t nanos) {
+		char ts[32];
+		std::snprintf(ts, sizeof(ts), "%lld.%03lld", static_cast<long long>(nanos / 1000), static_cast<long long>(nanos % 1000));
+		out << ts;
+	}
+}
+
+TraceBuffer::TraceBuffer(std::size_t capacity, std::string threadName) : thread_name_(std::move(threadName)) {
+	// One slot more than asked for, as events() skips the slot the writer may be overwriting.
+	std::size_t size = 1;
+	while (size < capacity + 1)
+		size <<= 1;
+	slots_ = std::make_unique<Slot[]>(size);
+	mask_ = size - 1;
+}
+
+std::vector<TraceBuffer::Event> TraceBuffer::events() const {
+	const std::uint64_t size = mask_ + 1;
+	const std::uint64_t end = head_.load(std::memory_order_acquire);
+	std::uint64_t begin = end > size ? end - size : 0;
+
+	std::vector<Event> events;
+	events.reserve(static_cast<std::size_t>(end - begin));
+	for (std::uint64_t i = begin; i < end; ++i) {
+		const Slot& slot = slots_[i & mask_];
+		const std::uint64_t typeArg = slot.type_arg.load(std::memory_order_relaxed);
+		events.push_back({ slot.time.load(std::memory_order_relaxed), static_cast<TraceEvent>(typeArg >> 32),
+			slot.label.load(std::memory_order_relaxed), static_cast<std::uint32_t>(typeArg) });
+	}
+
+	// Drop events the writer may have been overwriting while we read: it writes event i + size into event i's slot.
+	std::atomic_thread_fence(std::memory_order_acquire);
+	const std::uint64_t head = head_.load(std::memory_order_relaxed);
+	if (head + 1 > begin + size) {
+		const std::uint64_t overwritten = std::min<std::uint64_t>(head + 1 - size - begin, events.size());
+		events.erase(events.begin(), events.begin() + static_cast<std::ptrdiff_t>(overwritten));
+	}
+	return events;
+}
+
+void TraceBuffer::writeChromeTrace(std::ostream& out, const std::vector<const TraceBuffer*>& buffers) {
+	out << "{\"traceEvents\":[";
+	bool first = true;
+	const auto begin = [&out, &first](const char* phase, std::size_t tid, const char* name) {
+		out << (first ? "\n" : ",\n") << "{\"ph\":\"" << phase << "\",\"pid\":1,\"tid\":" << tid << ",\"name\":";
+		writeJsonString(out, name);
+		first = false;
+	};
+
+	for (std::size_t tid = 0; tid < buffers.size(); ++tid) {
+		begin("M", tid, "thread_name");
+		out << ",\"args\":{\"name\":";
+		writeJsonString(out, buffers[tid]->threadName().c_str());
+		out << "}}";
+
+		for (const Event& event : buffers[tid]->events()) {
+			switch (event.type) {
+			case TraceEvent::JOB_BEGIN: begin("B", tid, event.label ? event.label : "job"); break;
+			case TraceEvent::JOB_END:   begin("E", tid, "job"); break;
+			case TraceEvent::PARK:      begin("B", tid, "parked"); break;
+			case TraceEvent::UNPARK:    begin("E", tid, "parked"); break;
+			case TraceEvent::STEAL:     begin("i", tid, "steal"); out << ",\"s\":\"t\",\"args\":{\"node\":" << event.arg << '}'; break;
+			case TraceEvent::EXTEND:    begin("i", tid, "extend"); out << ",\"s\":\"p\",\"args\":{\"threads\":" << event.arg << '}'; break;
+			}
+			out << ",\"ts\":";
+			writeTimestamp(out, event.time);
+			out << '}';
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class TraceEvent : std::uint32_t {
+	JOB_BEGIN, // label: the job's label, or null.
+	JOB_END,
+	PARK,      // A worker waits for jobs.
+	UNPARK,
+	STEAL,     // arg: the NUMA node the job was taken from.
+	EXTEND,    // arg: threads added.
+};
+
+/* Fixed-size ring of trace events written by one thread, overwriting the oldest when full. Recording is a few
+   relaxed stores; any thread may read the events while it's being written, skipping those being overwritten. */
+class TraceBuffer {
+public:
+	struct Event {
+		std::int64_t time; // steady_clock nanoseconds.
+		TraceEvent type;
+		const char* label;
+		std::uint32_t arg;
+	};
+
+	// Keeps at least the last capacity events.
+	TraceBuffer(std::size_t capacity, std::string threadName);
+
+	void record(std::int64_t time, TraceEvent type, const char* label, std::uint32_t arg) noexcept {
+		const std::uint64_t head = head_.load(std::memory_order_relaxed);
+		Slot& slot = slots_[head & mask_];
+		slot.time.store(time, std::memory_order_relaxed);
+		slot.label.store(label, std::memory_order_relaxed);
+		slot.type_arg.store(static_cast<std::uint64_t>(type) << 32 | arg, std::memory_order_relaxed);
+		head_.store(head + 1, std::memory_order_release);
+	}
+
+	// The events still in the buffer, oldest first.
+	std::vector<Event> events() const;
+	const std::string& threadName() const { return thread_name_; }
+
+	// Write the buffers' events as Chrome Trace Event JSON, with one trace thread per buffer.
+	static void writeChromeTrace(std::ostream& out, const std::vector<const TraceBuffer*>& buffers);
+
+private:
+	struct Slot {
+		std::atomic<std::int64_t> time{0};
+		std::atomic<const char*> label{nullptr};
+		std::atomic<std::uint64_t> type_arg{0};
+	};
+	std::unique_ptr<Slot[]> slots_;
+	std::uint64_t mask_;
+	std::atomic<std::uint64_t> head_{0}; // Events ever recorded.
+	std::string thread_name_;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Threadpool.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+/* One T for each worker of a pool, so jobs can accumulate into their worker's copy without atomics or locks,
+   and the results can be combined once the jobs are done. Each copy is created on its worker's first local()
+   call, from init, and sits on cache lines of its own so workers don't contend for them.
+
+   local() may be called concurrently from jobs. Everything else must only be called once every job that called
+   local() has finished (e.g. after waiting on their futures, a TaskGroup or the pool). */
+template<typename T>
+class WorkerLocal {
+public:
+	explicit WorkerLocal(const Threadpool& pool, std::function<T()> init = [] { return T{}; })
+		: pool_(&pool), init_(std::move(init))
+	{}
+	~WorkerLocal() {
+		for (auto& segment : segments_)
+			delete[] segment.load(std::memory_order_relaxed);
+	}
+
+	WorkerLocal(const WorkerLocal&) = delete;
+	WorkerLocal& operator=(const WorkerLocal&) = delete;
+
+	// The calling worker's copy. Throws std::logic_error on threads that aren't the pool's workers.
+	T& local() {
+		const int worker = pool_->currentWorkerIndex();
+		if (worker < 0)
+			throw std::logic_error("WorkerLocal::local called from outside its pool's workers");
+		std::optional<T>& value = _slot(static_cast<std::size_t>(worker)).value;
+		if (!value)
+			value.emplace(init_());
+		return *value;
+	}
+
+	// Call func with every copy created so far, in worker order.
+	template<typename FuncType>
+	void forEach(FuncType&& func) {
+		for (std::size_t s = 0; s < SEGMENTS; ++s) {
+			Slot* segment = segments_[s].load(std::memory_order_acquire);
+			for (std::size_t i = 0; segment && i < _segment_size(s); ++i) {
+				if (segment[i].value)
+					func(*segment[i].value);
+			}
+		}
+	}
+
+	// Fold every copy into init() with op(T, const T&).
+	template<typename BinaryOp>
+	T combine(BinaryOp op) {
+		T result = init_();
+		forEach([&result, &op](const T& value) { result = op(std::move(result), value); });
+		return result;
+	}
+
+	// Number of copies created.
+	std::size_t size() {
+		std::size_t count = 0;
+		forEach([&count](const T&) { ++count; });
+		return count;
+	}
+
+	// Destroys every copy; workers get new ones on their next local() call.
+	void clear() {
+		for (std::size_t s = 0; s < SEGMENTS; ++s) {
+			Slot* segment = segments_[s].load(std::memory_order_acquire);
+			for (std::size_t i = 0; segment && i < _segment_size(s); ++i)
+				segment[i].value.reset();
+		}
+	}
+
+private:
+	struct alignas(Threadpool::CACHE_LINE_SIZE) Slot {
+		std::optional<T> value;
+	};
+
+	/* Slots live in segments that double in size, allocated on first use, so slots never move and the
+	   pool can grow without a lock here. Segment s holds worker indices [FIRST * (2^s - 1), FIRST * (2^(s+1) - 1)). */
+	static constexpr std::size_t FIRST = 8;
+	static constexpr std::size_t SEGMENTS = 48;
+
+	static std::size_t _segment_size(std::size_t segment) { return FIRST << segment; }
+
+	Slot& _slot(std::size_t index) {
+		std::size_t segment = 0;
+		while (index >= _segment_size(segment)) {
+			index -= _segment_size(segment);
+			++segment;
+		}
+		Slot* slots = segments_[segment].load(std::memory_order_acquire);
+		if (!slots) {
+			Slot* fresh = new Slot[_segment_size(segment)];
+			if (segments_[segment].compare_exchange_strong(slots, fresh, std::memory_order_acq_rel))
+				slots = fresh;
+			else
+				delete[] fresh; // Another worker allocated it first.
+		}
+		return slots[index];
+	}
+
+	const Threadpool* pool_;
+	std::function<T()> init_;
+	std::array<std::atomic<Slot*>, SEGMENTS> segments_{};
+};
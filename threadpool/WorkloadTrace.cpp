@@ -0,0 +1,136 @@
+#include "WorkloadTrace.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace {
+	constexpr char MAGIC[4] = { 'T', 'P', 'W', 'L' };
+	constexpr std::uint64_t VERSION = 1;
+
+	// LEB128: 7 bits per byte, low bits first, high bit set on all but the last byte.
+	void writeVarint(std::string& out, std::uint64_t value) {
+		while (value >= 0x80) {
+			out.push_back(static_cast<char>(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(static_cast<char>(value));
+	}
+
+	// Maps signed values to unsigned ones, keeping small negative values small.
+	void writeSigned(std::string& out, std::int64_t value) {
+		writeVarint(out, (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+	}
+
+	class Reader {
+	public:
+		explicit Reader(const std::string& data) : data_(data) {}
+
+		bool varint(std::uint64_t& value) {
+			value = 0;
+			for (unsigned int shift = 0; shift < 64 && pos_ < data_.size(); shift += 7) {
+				const auto byte = static_cast<unsigned char>(data_[pos_++]);
+				value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+					return true;
+			}
+			return false;
+		}
+		bool signedVarint(std::int64_t& value) {
+			std::uint64_t encoded;
+			if (!varint(encoded))
+				return false;
+			value = static_cast<std::int64_t>(encoded >> 1) ^ -static_cast<std::int64_t>(encoded & 1);
+			return true;
+		}
+		bool bytes(std::size_t count, std::string& out) {
+			if (data_.size() - pos_ < count)
+				return false;
+			out.assign(data_, pos_, count);
+			pos_ += count;
+			return true;
+		}
+
+	private:
+		const std::string& data_;
+		std::size_t pos_ = 0;
+	};
+}
+
+std::uint32_t WorkloadTrace::labelIndex(const char* label) {
+	if (!label)
+		return 0;
+	const auto found = std::find(labels.begin(), labels.end(), label);
+	if (found != labels.end())
+		return static_cast<std::uint32_t>(found - labels.begin());
+	labels.emplace_back(label);
+	return static_cast<std::uint32_t>(labels.size() - 1);
+}
+
+bool WorkloadTrace::save(const std::string& path) const {
+	std::string data(MAGIC, sizeof(MAGIC));
+	writeVarint(data, VERSION);
+	writeVarint(data, labels.size());
+	for (const std::string& label : labels) {
+		writeVarint(data, label.size());
+		data += label;
+	}
+	writeVarint(data, jobs.size());
+	std::int64_t previousSubmit = 0;
+	for (const Job& job : jobs) {
+		writeSigned(data, job.submit_ns - previousSubmit);
+		writeSigned(data, job.queue_wait_ns);
+		writeSigned(data, job.run_ns);
+		writeVarint(data, job.label);
+		previousSubmit = job.submit_ns;
+	}
+
+	std::ofstream out(path, std::ios::binary);
+	out.write(data.data(), static_cast<std::streamsize>(data.size()));
+	return static_cast<bool>(out.flush());
+}
+
+bool WorkloadTrace::load(const std::string& path) {
+	labels.clear();
+	jobs.clear();
+	std::ifstream in(path, std::ios::binary);
+	const std::string data{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+	Reader reader(data);
+
+	std::string magic;
+	std::uint64_t version = 0;
+	std::uint64_t count = 0;
+	if (!reader.bytes(sizeof(MAGIC), magic) || magic != std::string(MAGIC, sizeof(MAGIC)) || !reader.varint(version) || version != VERSION || !reader.varint(count))
+		return false;
+	for (std::uint64_t i = 0; i < count; ++i) {
+		std::uint64_t length = 0;
+		std::string label;
+		if (!reader.varint(length) || !reader.bytes(static_cast<std::size_t>(length), label)) {
+			labels.clear();
+			return false;
+		}
+		labels.push_back(std::move(label));
+	}
+
+	bool ok = reader.varint(count);
+	std::int64_t submit = 0;
+	for (std::uint64_t i = 0; ok && i < count; ++i) {
+		Job job{};
+		std::int64_t delta = 0;
+		std::uint64_t label = 0;
+		ok = reader.signedVarint(delta) && reader.signedVarint(job.queue_wait_ns) && reader.signedVarint(job.run_ns) &&
+			reader.varint(label) && label < labels.size();
+		if (!ok)
+			break;
+		submit += delta;
+		job.submit_ns = submit;
+		job.label = static_cast<std::uint32_t>(label);
+		jobs.push_back(job);
+	}
+	if (!ok || labels.empty()) {
+		labels.clear();
+		jobs.clear();
+		return false;
+	}
+	return true;
+}
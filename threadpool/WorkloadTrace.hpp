@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* The jobs a pool ran: when each was submitted, its label, how long it waited in the queue and how long it ran,
+   for replaying the same arrival pattern against other pool configurations. Saved in a compact binary format
+   of variable-length integers, with submit times stored as deltas. */
+struct WorkloadTrace {
+	struct Job {
+		std::int64_t submit_ns;     // Since the first job was submitted.
+		std::int64_t queue_wait_ns;
+		std::int64_t run_ns;        // Wall time.
+		std::uint32_t label;        // Index into labels.
+	};
+
+	std::vector<std::string> labels{ "" }; // Label 0 is for unlabelled jobs.
+	std::vector<Job> jobs;                 // In submit order.
+
+	// Index of the label, added if new. Null -> 0.
+	std::uint32_t labelIndex(const char* label);
+
+	// Return whether the file was written or read. A trace that fails to load is left empty.
+	bool save(const std::string& path) const;
+	bool load(const std::string& path);
+};